@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,272 +9,7558 @@
 #include <signal.h>
 #include <limits.h>
 #include <errno.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <sched.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <linux/sched.h>
 
 #define MAX_COMMAND_LINE_LEN 1024
 #define MAX_COMMAND_LINE_ARGS 128
 
 char prompt[] = "> ";
-char delimiters[] = " \t\r\n";
+char delimiters[] = " \t\r";
 extern char **environ;
 
-/* expand $VAR tokens via getenv into dst */
-static void expand_env(char *dst, size_t n, const char *src) {
-    if (src[0] == '$') {
-        const char *name = src + 1;
-        const char *val  = getenv(name);
-        snprintf(dst, n, "%s", val ? val : "");
+static _Thread_local int last_status;   // exit status of the last command
+static bool             interactive;   // reading commands from a terminal
+
+// the helper that starts external commands; see the launcher section
+static struct {
+    int   fd;                               // the shell's end, or -1
+    pid_t pid;
+    pid_t owner;                            // the shell it was forked for
+} launcher = { -1, 0, 0 };
+
+static void write_all(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+}
+
+struct strbuf {
+    char  *p;
+    size_t len, cap;
+};
+
+static void sb_put(struct strbuf *b, const char *s, size_t n) {
+    if (b->len + n + 1 > b->cap) {
+        while (b->len + n + 1 > b->cap) b->cap = b->cap ? b->cap * 2 : 256;
+        b->p = realloc(b->p, b->cap);
+    }
+    memcpy(b->p + b->len, s, n);
+    b->len += n;
+    b->p[b->len] = '\0';
+}
+
+/* ---- builtin output ----
+ * A builtin prints through its I/O context. Output is queued as a list of
+ * pieces, small ones copied into a growable buffer and long ones (argv
+ * strings, environment entries, history lines) referenced in place, and
+ * the whole list goes out with writev() when the builtin returns. */
+
+#define OUT_COPY_MAX 64             // shorter pieces are copied
+
+struct out_seg {
+    const char *p;                  // NULL: lives at off in bytes
+    size_t      off, len;
+};
+
+struct io {
+    int             in, out;        // fds the builtin reads and writes
+    struct ring    *ring_in;        // instead of in, when set
+    struct ring    *ring_out;       // instead of out, when set
+    struct inbuf   *inb;            // read-ahead of in; NULL: the shell's
+    struct strbuf  *assign;         // NAME\0VALUE\0 pairs to set after the
+                                    // stage is joined; NULL: set them now
+    struct out_seg *segs;
+    int             nsegs, cap;
+    struct strbuf   bytes;
+};
+
+static struct io io_main = { .in = STDIN_FILENO, .out = STDOUT_FILENO };
+static _Thread_local struct io *io = &io_main;
+
+/* Adjacent pipeline stages that both run on threads hand data over
+ * through a single-producer single-consumer ring instead of a kernel
+ * pipe. head and tail only grow and each has one writer, so moving data
+ * takes no lock. A side that finds the ring full (or empty) sleeps on a
+ * futex until the other side moves, which gives the producer
+ * backpressure. */
+
+#define RING_SIZE (64 * 1024)
+
+struct ring {
+    _Atomic size_t   head, tail;    // bytes written / read so far
+    _Atomic uint32_t seq;           // bumped by every move; the futex word
+    _Atomic uint32_t sleepers;
+    _Atomic bool     write_closed, read_closed;
+    char             buf[RING_SIZE];
+};
+
+static void ring_moved(struct ring *r) {
+    atomic_fetch_add(&r->seq, 1);
+    if (atomic_load(&r->sleepers))
+        syscall(SYS_futex, &r->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* sleep unless the ring moved since seq was read */
+static void ring_wait(struct ring *r, uint32_t seq) {
+    atomic_fetch_add(&r->sleepers, 1);
+    syscall(SYS_futex, &r->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+    atomic_fetch_sub(&r->sleepers, 1);
+}
+
+/* all of p, waiting for room; -1 once the reader is gone */
+static int ring_write(struct ring *r, const char *p, size_t n) {
+    while (n > 0) {
+        uint32_t seq = atomic_load(&r->seq);
+        if (atomic_load(&r->read_closed)) return -1;
+        size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        size_t room = RING_SIZE - (head - atomic_load(&r->tail));
+        if (!room) {
+            ring_wait(r, seq);
+            continue;
+        }
+        size_t at = head % RING_SIZE, k = n;
+        if (k > room) k = room;
+        if (k > RING_SIZE - at) k = RING_SIZE - at;
+        memcpy(r->buf + at, p, k);
+        atomic_store(&r->head, head + k);
+        ring_moved(r);
+        p += k;
+        n -= k;
+    }
+    return 0;
+}
+
+/* up to n bytes, waiting for some; 0 once the writer is done */
+static size_t ring_read(struct ring *r, char *dst, size_t n) {
+    for (;;) {
+        uint32_t seq = atomic_load(&r->seq);
+        bool done = atomic_load(&r->write_closed);
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        size_t avail = atomic_load(&r->head) - tail;
+        if (!avail) {
+            if (done) return 0;
+            ring_wait(r, seq);
+            continue;
+        }
+        size_t at = tail % RING_SIZE, k = n;
+        if (k > avail) k = avail;
+        if (k > RING_SIZE - at) k = RING_SIZE - at;
+        memcpy(dst, r->buf + at, k);
+        atomic_store(&r->tail, tail + k);
+        ring_moved(r);
+        return k;
+    }
+}
+
+static void ring_close(struct ring *r, bool reader) {
+    atomic_store(reader ? &r->read_closed : &r->write_closed, true);
+    ring_moved(r);
+}
+
+static void writev_all(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+}
+
+static struct out_seg *out_seg(void) {
+    if (io->nsegs == io->cap) {
+        io->cap = io->cap ? io->cap * 2 : 64;
+        io->segs = realloc(io->segs, (size_t)io->cap * sizeof(*io->segs));
+    }
+    return &io->segs[io->nsegs++];
+}
+
+/* the bytes just appended to io->bytes, as output */
+static void out_took(size_t off) {
+    struct out_seg *last = io->nsegs ? &io->segs[io->nsegs - 1] : NULL;
+
+    if (last && !last->p && last->off + last->len == off)
+        last->len += io->bytes.len - off;
+    else
+        *out_seg() = (struct out_seg){ NULL, off, io->bytes.len - off };
+}
+
+static void out_put(const char *s, size_t n) {
+    size_t off = io->bytes.len;
+    sb_put(&io->bytes, s, n);
+    out_took(off);
+}
+
+/* s must stay valid until the builtin's output is flushed */
+static void out_ref(const char *s, size_t n) {
+    if (n < OUT_COPY_MAX) out_put(s, n);
+    else *out_seg() = (struct out_seg){ s, 0, n };
+}
+
+static void out_str(const char *s) {
+    out_put(s, strlen(s));
+}
+
+__attribute__((format(printf, 1, 2)))
+static void out_printf(const char *fmt, ...) {
+    struct strbuf *b = &io->bytes;
+    size_t off = b->len;
+    va_list ap;
+
+    sb_put(b, "", 0);
+    va_start(ap, fmt);
+    int n = vsnprintf(b->p + off, b->cap - off, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n >= b->cap - off) {
+        while (b->cap - off < (size_t)n + 1) b->cap *= 2;
+        b->p = realloc(b->p, b->cap);
+        va_start(ap, fmt);
+        vsnprintf(b->p + off, (size_t)n + 1, fmt, ap);
+        va_end(ap);
+    }
+    b->len += (size_t)n;
+    out_took(off);
+}
+
+static void out_flush(void) {
+    struct iovec iov[64];
+
+    if (io == &io_main) fflush(stdout);     // whatever stdio holds goes first
+    if (io->ring_out) {
+        for (int i = 0; i < io->nsegs; i++) {
+            const struct out_seg *sg = &io->segs[i];
+            if (ring_write(io->ring_out, sg->p ? sg->p : io->bytes.p + sg->off,
+                           sg->len) < 0)
+                break;
+        }
+        io->nsegs = 0;
+        io->bytes.len = 0;
+        return;
+    }
+    for (int i = 0; i < io->nsegs; ) {
+        int k = 0;
+        for (; k < 64 && i < io->nsegs; k++, i++) {
+            const struct out_seg *sg = &io->segs[i];
+            iov[k].iov_base = (void *)(sg->p ? sg->p : io->bytes.p + sg->off);
+            iov[k].iov_len = sg->len;
+        }
+        writev_all(io->out, iov, k);
+    }
+    io->nsegs = 0;
+    io->bytes.len = 0;
+}
+
+/* ---- history ----
+ * One append-only file shared by every session. Each entry is a single
+ * O_APPEND write() of "line\n", so concurrent shells never interleave and
+ * never take a lock. Reading goes through a read-only mmap; the offset
+ * index and the dedup table are built on first use and afterwards only
+ * extended over whatever bytes other sessions have appended since. */
+
+struct history {
+    int       fd;
+    char     *map;
+    size_t    map_len;
+    size_t    scanned;      // bytes already indexed
+    size_t   *off;          // offset of each entry
+    size_t    count, cap;
+    uint32_t *dedup;        // open-addressed, text id + 1, 0 = empty
+    size_t    dedup_cap;
+    uint32_t *latest;       // newest entry for each distinct text
+    size_t    ntexts, texts_cap;
+    unsigned  generation;   // bumped whenever the index is dropped
+};
+
+static struct history hist = { .fd = -1 };
+
+static uint32_t hash_bytes(const char *p, size_t n) {
+    uint32_t h = 2166136261u;                 // FNV-1a
+    while (n--) {
+        h ^= (unsigned char)*p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static const char *hist_entry(size_t i, size_t *len) {
+    size_t end = (i + 1 < hist.count) ? hist.off[i + 1] : hist.scanned;
+    *len = end - hist.off[i] - 1;             // drop the newline
+    return hist.map + hist.off[i];
+}
+
+/* slot holding the text s (or the empty slot where it would go) */
+static size_t hist_text_slot(const char *s, size_t len) {
+    size_t olen;
+    size_t mask = hist.dedup_cap - 1;
+    size_t slot = hash_bytes(s, len) & mask;
+
+    while (hist.dedup[slot]) {
+        const char *o = hist_entry(hist.latest[hist.dedup[slot] - 1], &olen);
+        if (olen == len && memcmp(o, s, len) == 0) break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static void hist_dedup_insert(size_t i) {
+    size_t len;
+    const char *s;
+
+    if ((hist.ntexts + 1) * 2 > hist.dedup_cap) {
+        uint32_t *old = hist.dedup;
+        size_t old_cap = hist.dedup_cap;
+
+        hist.dedup_cap = old_cap ? old_cap * 2 : 1024;
+        hist.dedup = calloc(hist.dedup_cap, sizeof(*hist.dedup));
+        for (size_t k = 0; k < old_cap; k++) {
+            if (!old[k]) continue;
+            s = hist_entry(hist.latest[old[k] - 1], &len);
+            hist.dedup[hist_text_slot(s, len)] = old[k];
+        }
+        free(old);
+    }
+
+    s = hist_entry(i, &len);
+    size_t slot = hist_text_slot(s, len);
+    if (!hist.dedup[slot]) {
+        if (hist.ntexts == hist.texts_cap) {
+            hist.texts_cap = hist.texts_cap ? hist.texts_cap * 2 : 1024;
+            hist.latest = realloc(hist.latest,
+                                  hist.texts_cap * sizeof(*hist.latest));
+        }
+        hist.dedup[slot] = (uint32_t)++hist.ntexts;
+    }
+    hist.latest[hist.dedup[slot] - 1] = (uint32_t)i;
+}
+
+/* true if no later entry has the same text */
+static bool hist_is_latest(size_t i) {
+    size_t len;
+    const char *s = hist_entry(i, &len);
+    return hist.latest[hist.dedup[hist_text_slot(s, len)] - 1] == i;
+}
+
+/* forget the index, for a file another session truncated or rewrote */
+static void hist_reset(void) {
+    if (hist.map) munmap(hist.map, hist.map_len);
+    hist.map = NULL;
+    hist.map_len = hist.scanned = hist.count = hist.ntexts = 0;
+    if (hist.dedup) memset(hist.dedup, 0, hist.dedup_cap * sizeof(*hist.dedup));
+    hist.generation++;
+}
+
+/* map and index whatever has been appended since the last call */
+static void hist_sync(void) {
+    struct stat st;
+
+    if (hist.fd < 0 || fstat(hist.fd, &st) < 0) return;
+    size_t size = (size_t)st.st_size;
+    // shrunk, or no longer ending where our last entry did: the old
+    // mapping reaches past EOF and the offsets are stale
+    if (size < hist.scanned ||
+        (hist.scanned && hist.map[hist.scanned - 1] != '\n'))
+        hist_reset();
+    if (size <= hist.scanned) return;
+
+    if (size != hist.map_len) {
+        char *m = hist.map
+            ? mremap(hist.map, hist.map_len, size, MREMAP_MAYMOVE)
+            : mmap(NULL, size, PROT_READ, MAP_SHARED, hist.fd, 0);
+        if (m == MAP_FAILED) return;
+        hist.map = m;
+        hist.map_len = size;
+    }
+
+    const char *p = hist.map + hist.scanned, *end = hist.map + size;
+    const char *nl;
+    while ((nl = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        if (hist.count == hist.cap) {
+            hist.cap = hist.cap ? hist.cap * 2 : 1024;
+            hist.off = realloc(hist.off, hist.cap * sizeof(*hist.off));
+        }
+        hist.off[hist.count++] = (size_t)(p - hist.map);
+        hist.scanned = (size_t)(nl + 1 - hist.map);
+        hist_dedup_insert(hist.count - 1);
+        p = nl + 1;
+    }
+}
+
+static void hist_open(void) {
+    char path[PATH_MAX];
+    const char *file = getenv("HISTFILE");
+    const char *home = getenv("HOME");
+
+    if (!file) {
+        if (!home) return;
+        snprintf(path, sizeof(path), "%s/.shell_history", home);
+        file = path;
+    }
+    hist.fd = open(file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+}
+
+static void hist_add(const char *line) {
+    char rec[MAX_COMMAND_LINE_LEN + 1];
+    size_t n = strlen(line);
+
+    if (hist.fd < 0 || n == 0) return;
+    memcpy(rec, line, n);
+    rec[n++] = '\n';
+    // one write per record keeps concurrent appends whole
+    if (write(hist.fd, rec, n) < 0) perror("history");
+}
+
+/* ---- history search ----
+ * Trigram index over the distinct history texts: each of 64k buckets
+ * holds the ascending ids of texts containing a trigram that hashes
+ * there. A query walks the shortest list among its trigrams and confirms
+ * candidates with memmem(). The index is built on the first search and
+ * then extended with texts appended since. Patterns shorter than a
+ * trigram scan backwards instead; they match almost immediately. */
+
+#define TRI_BUCKETS (1u << 16)
+
+struct posting {
+    uint32_t *ids;
+    uint32_t  len, cap;
+};
+
+static struct posting *tri;      // NULL until the first search
+static size_t tri_texts;         // texts indexed so far
+static unsigned tri_generation;  // hist.generation they were indexed under
+
+static uint32_t tri_hash(const char *p) {
+    uint32_t v = (uint32_t)(unsigned char)p[0] << 16 |
+                 (uint32_t)(unsigned char)p[1] << 8 |
+                 (uint32_t)(unsigned char)p[2];
+    return (v * 2654435761u) >> 16;
+}
+
+static void tri_sync(void) {
+    size_t len;
+
+    if (!tri) tri = calloc(TRI_BUCKETS, sizeof(*tri));
+    if (tri_generation != hist.generation) {
+        for (size_t b = 0; b < TRI_BUCKETS; b++) tri[b].len = 0;
+        tri_texts = 0;
+        tri_generation = hist.generation;
+    }
+    for (; tri_texts < hist.ntexts; tri_texts++) {
+        const char *s = hist_entry(hist.latest[tri_texts], &len);
+        for (size_t k = 0; k + 3 <= len; k++) {
+            struct posting *pl = &tri[tri_hash(s + k)];
+            if (pl->len && pl->ids[pl->len - 1] == tri_texts) continue;
+            if (pl->len == pl->cap) {
+                pl->cap = pl->cap ? pl->cap * 2 : 4;
+                pl->ids = realloc(pl->ids, pl->cap * sizeof(*pl->ids));
+            }
+            pl->ids[pl->len++] = (uint32_t)tri_texts;
+        }
+    }
+}
+
+/* shortest posting list among the trigrams of pat (plen >= 3) */
+static struct posting *tri_rarest(const char *pat, size_t plen) {
+    struct posting *pl = &tri[tri_hash(pat)];
+    for (size_t k = 1; k + 3 <= plen; k++) {
+        struct posting *q = &tri[tri_hash(pat + k)];
+        if (q->len < pl->len) pl = q;
+    }
+    return pl;
+}
+
+/* newest distinct entry before `before` containing pat, or SIZE_MAX */
+static size_t hist_search(const char *pat, size_t plen, size_t before) {
+    size_t len, best = SIZE_MAX;
+
+    hist_sync();
+    if (before > hist.count) before = hist.count;   // it may have shrunk
+    if (plen < 3) {
+        while (before-- > 0) {
+            const char *s = hist_entry(before, &len);
+            if (memmem(s, len, pat, plen) && hist_is_latest(before))
+                return before;
+        }
+        return SIZE_MAX;
+    }
+
+    tri_sync();
+    struct posting *pl = tri_rarest(pat, plen);
+    for (uint32_t k = 0; k < pl->len; k++) {
+        size_t i = hist.latest[pl->ids[k]];
+        if (i >= before || (best != SIZE_MAX && i <= best)) continue;
+        const char *s = hist_entry(i, &len);
+        if (memmem(s, len, pat, plen)) best = i;
+    }
+    return best;
+}
+
+static int cmp_size(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* every distinct entry containing pat, oldest first; caller frees *out */
+static size_t hist_search_all(const char *pat, size_t plen, size_t **out) {
+    size_t n = 0, cap = 16, len;
+    size_t *hits = malloc(cap * sizeof(*hits));
+
+    hist_sync();
+    if (plen < 3) {
+        for (size_t i = 0; i < hist.count; i++) {
+            const char *s = hist_entry(i, &len);
+            if (!memmem(s, len, pat, plen) || !hist_is_latest(i)) continue;
+            if (n == cap) hits = realloc(hits, (cap *= 2) * sizeof(*hits));
+            hits[n++] = i;
+        }
+    } else {
+        tri_sync();
+        struct posting *pl = tri_rarest(pat, plen);
+        for (uint32_t k = 0; k < pl->len; k++) {
+            size_t i = hist.latest[pl->ids[k]];
+            const char *s = hist_entry(i, &len);
+            if (!memmem(s, len, pat, plen)) continue;
+            if (n == cap) hits = realloc(hits, (cap *= 2) * sizeof(*hits));
+            hits[n++] = i;
+        }
+        qsort(hits, n, sizeof(*hits), cmp_size);
+    }
+    *out = hits;
+    return n;
+}
+
+/* ---- command cache ----
+ * Executables found on PATH, kept per directory as a sorted name list and
+ * merged into one sorted table for prefix search. A directory is only
+ * re-read when its mtime changes, which is all we can rely on for NFS
+ * entries. Completion revalidates on every Tab; command lookup trusts the
+ * table like a hash cache and the child falls back to execvp() on a miss. */
+
+struct path_dir {
+    char  *path;
+    struct timespec mtime;
+    bool   scanned;
+    char **names;
+    size_t count;
+};
+
+struct cmd_entry {
+    const char *name;
+    size_t      dir;     // index into path_dirs
+};
+
+static struct path_dir  *path_dirs;
+static size_t            npath_dirs;
+static char             *path_value;   // PATH the table was built from
+static struct cmd_entry *cmds;
+static size_t            ncmds;
+static bool              cmds_stale = true;
+
+static int cmp_str(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int cmp_cmd(const void *a, const void *b) {
+    const struct cmd_entry *x = a, *y = b;
+    int r = strcmp(x->name, y->name);
+    if (r) return r;
+    return (x->dir > y->dir) - (x->dir < y->dir);
+}
+
+static void path_dir_free(struct path_dir *d) {
+    for (size_t i = 0; i < d->count; i++) free(d->names[i]);
+    free(d->names);
+    d->names = NULL;
+    d->count = 0;
+}
+
+static void path_dir_scan(struct path_dir *d) {
+    size_t cap = 0;
+    int dfd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = dfd >= 0 ? fdopendir(dfd) : NULL;
+
+    path_dir_free(d);
+    d->scanned = true;
+    if (!dir) {
+        if (dfd >= 0) close(dfd);
+        return;
+    }
+    for (struct dirent *de; (de = readdir(dir)) != NULL; ) {
+        if (de->d_name[0] == '.' || de->d_type == DT_DIR) continue;
+        if (faccessat(dfd, de->d_name, X_OK, 0) != 0) continue;
+        if (d->count == cap) {
+            cap = cap ? cap * 2 : 64;
+            d->names = realloc(d->names, cap * sizeof(*d->names));
+        }
+        d->names[d->count++] = strdup(de->d_name);
+    }
+    closedir(dir);
+    qsort(d->names, d->count, sizeof(*d->names), cmp_str);
+}
+
+/* re-read directories whose mtime moved; rebuild after a PATH change */
+static void path_cache_sync(void) {
+    const char *path = getenv("PATH");
+    struct stat st;
+
+    if (!path) path = "";
+    if (!path_value || strcmp(path, path_value) != 0) {
+        for (size_t i = 0; i < npath_dirs; i++) {
+            path_dir_free(&path_dirs[i]);
+            free(path_dirs[i].path);
+        }
+        free(path_value);
+        path_value = strdup(path);
+        npath_dirs = 0;
+        for (const char *p = path; ; ) {
+            size_t n = strcspn(p, ":");
+            path_dirs = realloc(path_dirs,
+                                (npath_dirs + 1) * sizeof(*path_dirs));
+            struct path_dir *d = &path_dirs[npath_dirs++];
+            memset(d, 0, sizeof(*d));
+            d->path = n ? strndup(p, n) : strdup(".");
+            if (!p[n]) break;
+            p += n + 1;
+        }
+        cmds_stale = true;
+    }
+
+    for (size_t i = 0; i < npath_dirs; i++) {
+        struct path_dir *d = &path_dirs[i];
+        if (stat(d->path, &st) != 0) {
+            if (d->count) cmds_stale = true;
+            path_dir_free(d);
+            continue;
+        }
+        if (d->scanned && st.st_mtim.tv_sec == d->mtime.tv_sec &&
+            st.st_mtim.tv_nsec == d->mtime.tv_nsec)
+            continue;
+        d->mtime = st.st_mtim;
+        path_dir_scan(d);
+        cmds_stale = true;
+    }
+
+    if (!cmds_stale) return;
+    size_t total = 0;
+    for (size_t i = 0; i < npath_dirs; i++) total += path_dirs[i].count;
+    cmds = realloc(cmds, (total ? total : 1) * sizeof(*cmds));
+    ncmds = 0;
+    for (size_t i = 0; i < npath_dirs; i++)
+        for (size_t k = 0; k < path_dirs[i].count; k++)
+            cmds[ncmds++] = (struct cmd_entry){ path_dirs[i].names[k], i };
+    qsort(cmds, ncmds, sizeof(*cmds), cmp_cmd);
+
+    // keep only the first PATH directory providing each name
+    size_t out = 0;
+    for (size_t i = 0; i < ncmds; i++)
+        if (!out || strcmp(cmds[out - 1].name, cmds[i].name) != 0)
+            cmds[out++] = cmds[i];
+    ncmds = out;
+    cmds_stale = false;
+}
+
+/* first table index whose name is >= prefix */
+static size_t cmd_lower_bound(const char *prefix) {
+    size_t lo = 0, hi = ncmds;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(cmds[mid].name, prefix) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* full path of a PATH command into buf, or NULL if it is not cached */
+static const char *cmd_lookup(const char *name, char *buf, size_t n) {
+    const char *path = getenv("PATH");
+
+    if (strchr(name, '/')) return NULL;
+    if (!path_value || strcmp(path ? path : "", path_value) != 0)
+        path_cache_sync();
+
+    size_t i = cmd_lower_bound(name);
+    if (i == ncmds || strcmp(cmds[i].name, name) != 0) return NULL;
+    snprintf(buf, n, "%s/%s", path_dirs[cmds[i].dir].path, name);
+    return buf;
+}
+
+/* drop everything; the next lookup rescans PATH */
+static void cmd_forget(void) {
+    free(path_value);
+    path_value = NULL;
+}
+
+/* ---- completion ---- */
+
+static atomic_uint ed_gen = 1;     // bumped by every editor keystroke
+
+static const char *builtin_names[] = {
+    ".", "[", "alias", "cd", "cgroup", "dirs", "echo", "env", "exit", "hash", "history",
+    "ionice", "job-oom", "jobs", "memo", "nice", "popd", "printf", "prlimit", "pushd", "pwd",
+    "read", "return", "sched", "setenv", "source", "test", "ulimit", "unalias",
+    "z", NULL
+};
+
+static bool is_builtin(const char *name) {
+    for (const char **b = builtin_names; *b; b++)
+        if (strcmp(*b, name) == 0) return true;
+    return false;
+}
+
+struct completions {
+    char **v;
+    size_t n, cap;
+};
+
+static void comp_add(struct completions *c, const char *name, bool dir) {
+    if (c->n == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 32;
+        c->v = realloc(c->v, c->cap * sizeof(*c->v));
+    }
+    size_t len = strlen(name);
+    char *s = malloc(len + 2);
+    memcpy(s, name, len);
+    if (dir) s[len++] = '/';
+    s[len] = '\0';
+    c->v[c->n++] = s;
+}
+
+static void comp_free(struct completions *c) {
+    for (size_t i = 0; i < c->n; i++) free(c->v[i]);
+    free(c->v);
+}
+
+static void complete_command(struct completions *c, const char *prefix) {
+    size_t plen = strlen(prefix);
+
+    for (const char **b = builtin_names; *b; b++)
+        if (strncmp(*b, prefix, plen) == 0) comp_add(c, *b, false);
+    path_cache_sync();
+    for (size_t i = cmd_lower_bound(prefix);
+         i < ncmds && strncmp(cmds[i].name, prefix, plen) == 0; i++)
+        comp_add(c, cmds[i].name, false);
+
+    // builtins shadow PATH commands of the same name
+    qsort(c->v, c->n, sizeof(*c->v), cmp_str);
+    size_t out = 0;
+    for (size_t i = 0; i < c->n; i++) {
+        if (out && strcmp(c->v[out - 1], c->v[i]) == 0) free(c->v[i]);
+        else c->v[out++] = c->v[i];
+    }
+    c->n = out;
+}
+
+/* names in dir starting with prefix; gives up once ed_gen moves past gen */
+static void complete_file(struct completions *c, const char *dir,
+                          const char *prefix, unsigned gen) {
+    size_t plen = strlen(prefix);
+    DIR *d = opendir(*dir ? dir : ".");
+
+    if (!d) return;
+    for (struct dirent *de; (de = readdir(d)) != NULL; ) {
+        const char *n = de->d_name;
+        if (gen && gen != atomic_load(&ed_gen)) break;
+        if (n[0] == '.' && prefix[0] != '.') continue;
+        if (!strcmp(n, ".") || !strcmp(n, "..")) continue;
+        if (strncmp(n, prefix, plen) != 0) continue;
+
+        bool is_dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_LNK || de->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dirfd(d), n, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        comp_add(c, n, is_dir);
+    }
+    closedir(d);
+    qsort(c->v, c->n, sizeof(*c->v), cmp_str);
+}
+
+/* ---- background tasks ----
+ * A couple of worker threads for work the input loop must not wait on:
+ * prompt segments (VCS status, kube context) and file-name completion.
+ * Finished tasks are queued back and announced through an eventfd that
+ * the editor polls alongside the terminal. Completion tasks carry the
+ * editor generation they were issued at and are dropped once a newer
+ * keystroke has bumped it. */
+
+#define NWORKERS 2
+
+enum task_kind { TASK_PROMPT, TASK_COMPLETE };
+
+struct task {
+    struct task   *next;
+    enum task_kind kind;
+    unsigned       gen;            // editor generation at submit time
+    bool           again;          // completion: second tab in a row
+    char           dir[PATH_MAX];  // cwd, or directory to complete in
+    char           arg[PATH_MAX];  // kubeconfig path, or word prefix
+    struct completions comps;
+    char           git[64], kube[128];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    struct task    *head, *tail;   // waiting for a worker
+    struct task    *done;          // finished, not yet collected
+    int             efd;
+} tasks = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+            NULL, NULL, NULL, -1 };
+
+/* " (branch)" for the repository holding cwd; '*' marks local changes */
+static void git_segment(const char *cwd, char *out, size_t n) {
+    char path[PATH_MAX], probe[PATH_MAX + 8], buf[4096];
+    int fds[2];
+    pid_t pid;
+
+    out[0] = '\0';
+    snprintf(path, sizeof(path), "%s", cwd);
+    for (;;) {
+        snprintf(probe, sizeof(probe), "%s/.git", path);
+        if (access(probe, F_OK) == 0) break;
+        char *sl = strrchr(path, '/');
+        if (!sl || sl == path) {
+            if (strcmp(path, "/") == 0 || !sl) return;
+            path[1] = '\0';
+        } else {
+            *sl = '\0';
+        }
+    }
+
+    char *argv[] = { "git", "-C", (char *)cwd, "status", "--porcelain",
+                     "-b", "--untracked-files=no", NULL };
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t none;
+
+    if (pipe2(fds, O_CLOEXEC) < 0) return;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    posix_spawnattr_init(&attr);
+    sigemptyset(&none);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    int err = posix_spawnp(&pid, "git", &fa, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    close(fds[1]);
+    if (err) {
+        close(fds[0]);
+        return;
+    }
+
+    size_t len = 0;
+    ssize_t r;
+    while (len < sizeof(buf) - 1 &&
+           (r = read(fds[0], buf + len, sizeof(buf) - 1 - len)) != 0) {
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        len += (size_t)r;
+    }
+    buf[len] = '\0';
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+
+    // "## main...origin/main [ahead 1]", "## No commits yet on main"
+    if (strncmp(buf, "## ", 3) != 0) return;
+    char *line_end = strchr(buf, '\n');
+    if (line_end) *line_end = '\0';
+    char *branch = buf + 3, *dots = strstr(branch, "...");
+    if (dots) *dots = '\0';
+    char *sp = strrchr(branch, ' ');
+    if (sp && !dots) branch = strncmp(branch, "HEAD ", 5) ? sp + 1 : "HEAD";
+    bool dirty = line_end && line_end[1] != '\0';
+    snprintf(out, n, "%.60s%s", branch, dirty ? "*" : "");
+}
+
+/* current-context from a kubeconfig file */
+static void kube_segment(const char *file, char *out, size_t n) {
+    char line[512];
+    FILE *f = *file ? fopen(file, "re") : NULL;
+
+    out[0] = '\0';
+    if (!f) return;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "current-context:", 16) != 0) continue;
+        char *v = line + 16;
+        v += strspn(v, " \t\"'");
+        v[strcspn(v, "\"'\r\n")] = '\0';
+        snprintf(out, n, "%s", v);
+        break;
+    }
+    fclose(f);
+}
+
+static void *task_worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&tasks.lock);
+        while (!tasks.head) pthread_cond_wait(&tasks.wake, &tasks.lock);
+        struct task *t = tasks.head;
+        tasks.head = t->next;
+        if (!tasks.head) tasks.tail = NULL;
+        pthread_mutex_unlock(&tasks.lock);
+
+        if (t->kind == TASK_PROMPT) {
+            git_segment(t->dir, t->git, sizeof(t->git));
+            kube_segment(t->arg, t->kube, sizeof(t->kube));
+        } else if (t->gen == atomic_load(&ed_gen)) {
+            complete_file(&t->comps, t->dir, t->arg, t->gen);
+        }
+
+        pthread_mutex_lock(&tasks.lock);
+        t->next = tasks.done;
+        tasks.done = t;
+        pthread_mutex_unlock(&tasks.lock);
+        uint64_t one = 1;
+        if (write(tasks.efd, &one, sizeof(one)) < 0) { /* counter full */ }
+    }
+    return NULL;
+}
+
+static void tasks_start(void) {
+    sigset_t all, old;
+    pthread_t tid;
+
+    tasks.efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (tasks.efd < 0) return;
+    // signals stay with the main thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (int i = 0; i < NWORKERS; i++) {
+        if (pthread_create(&tid, NULL, task_worker, NULL) == 0)
+            pthread_detach(tid);
+        else if (i == 0) {
+            close(tasks.efd);
+            tasks.efd = -1;
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void task_submit(struct task *t) {
+    t->next = NULL;
+    pthread_mutex_lock(&tasks.lock);
+    if (tasks.tail) tasks.tail->next = t;
+    else tasks.head = t;
+    tasks.tail = t;
+    pthread_cond_signal(&tasks.wake);
+    pthread_mutex_unlock(&tasks.lock);
+}
+
+/* take every finished task; the caller frees them */
+static struct task *tasks_collect(void) {
+    uint64_t count;
+
+    if (read(tasks.efd, &count, sizeof(count)) < 0) { /* nothing yet */ }
+    pthread_mutex_lock(&tasks.lock);
+    struct task *t = tasks.done;
+    tasks.done = NULL;
+    pthread_mutex_unlock(&tasks.lock);
+    return t;
+}
+
+static void task_free(struct task *t) {
+    comp_free(&t->comps);
+    free(t);
+}
+
+/* ---- directory frecency ----
+ * Visits recorded by cd, kept in one mmap'd file: a header, fixed-size
+ * records sorted by lower-cased basename (then path), and a string pool.
+ * Revisiting a directory bumps its record in place; only a new directory
+ * or periodic aging rewrites the file, atomically via rename(). Sessions
+ * notice a rewrite by the inode changing under them. `z foo` binary
+ * searches the basename order for the prefix "foo" and takes the best
+ * frecency in that range, falling back to a substring scan of the paths. */
+
+#define Z_MAGIC     "shz1"
+#define Z_MAX_TOTAL 9000.0f          // age everything once scores sum past this
+
+struct z_header {
+    char     magic[4];
+    uint32_t count;
+    uint32_t pool_len;
+    float    total;                  // sum of scores
+};
+
+struct z_rec {
+    float    score;
+    uint32_t last;                   // time of last visit
+    uint32_t path_off;               // into the pool, NUL-terminated
+    uint16_t path_len;
+    uint16_t base_off;               // basename offset within the path
+};
+
+static struct {
+    char   *map;
+    size_t  len;
+    ino_t   ino;
+    char    file[PATH_MAX];
+} zdb;
+
+#define Z_HDR()     ((struct z_header *)zdb.map)
+#define Z_RECS()    ((struct z_rec *)(zdb.map + sizeof(struct z_header)))
+#define Z_POOL()    ((char *)(Z_RECS() + Z_HDR()->count))
+#define Z_PATH(r)   (Z_POOL() + (r)->path_off)
+#define Z_BASE(r)   (Z_PATH(r) + (r)->base_off)
+
+/* (re)map the data file if it was replaced since we last looked */
+static bool z_sync(void) {
+    struct stat st;
+
+    if (!zdb.file[0]) {
+        const char *f = getenv("_Z_DATA"), *home = getenv("HOME");
+        if (f) snprintf(zdb.file, sizeof(zdb.file), "%s", f);
+        else if (home) snprintf(zdb.file, sizeof(zdb.file), "%s/.shell_z", home);
+        else return false;
+    }
+    if (stat(zdb.file, &st) < 0) {
+        if (zdb.map) munmap(zdb.map, zdb.len);
+        zdb.map = NULL;
+        return false;
+    }
+    if (zdb.map && st.st_ino == zdb.ino && (size_t)st.st_size == zdb.len)
+        return true;
+
+    if (zdb.map) munmap(zdb.map, zdb.len);
+    zdb.map = NULL;
+    int fd = open(zdb.file, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return false;
+    if ((size_t)st.st_size >= sizeof(struct z_header)) {
+        zdb.map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+        if (zdb.map == MAP_FAILED) zdb.map = NULL;
+    }
+    close(fd);
+    zdb.len = (size_t)st.st_size;
+    zdb.ino = st.st_ino;
+
+    struct z_header *h = (struct z_header *)zdb.map;
+    if (zdb.map && (memcmp(h->magic, Z_MAGIC, 4) != 0 ||
+                    sizeof(*h) + (size_t)h->count * sizeof(struct z_rec) +
+                    h->pool_len != zdb.len)) {
+        munmap(zdb.map, zdb.len);
+        zdb.map = NULL;
+    }
+    return zdb.map != NULL;
+}
+
+static int z_cmp(const char *base, const char *path, const struct z_rec *r) {
+    int c = strcasecmp(base, Z_BASE(r));
+    return c ? c : strcmp(path, Z_PATH(r));
+}
+
+/* index of the first record not ordered before (base, path) */
+static size_t z_lower_bound(const char *base, const char *path) {
+    size_t lo = 0, hi = zdb.map ? Z_HDR()->count : 0;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (z_cmp(base, path, &Z_RECS()[mid]) > 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* write a new file holding the current records plus an optional new
+ * one at index `at`, scaling every score by `age` and dropping what
+ * falls below one visit */
+static void z_rewrite(size_t at, const char *add, uint32_t now, float age) {
+    uint32_t count = zdb.map ? Z_HDR()->count : 0;
+    size_t pool = zdb.map ? Z_HDR()->pool_len : 0;
+    size_t cap = sizeof(struct z_header) +
+                 (count + 1) * sizeof(struct z_rec) + pool + PATH_MAX;
+    char *buf = calloc(1, cap);
+    struct z_rec *recs = (struct z_rec *)(buf + sizeof(struct z_header));
+    uint32_t n = 0;
+    float total = 0;
+
+    // records first, then the pool they point into
+    for (uint32_t i = 0; i <= count; i++) {
+        if (add && i == at) {
+            recs[n].score = 1;
+            recs[n].last = now;
+            recs[n].path_len = (uint16_t)strlen(add);
+            const char *b = strrchr(add, '/');
+            recs[n].base_off = (uint16_t)(b && b[1] ? b + 1 - add : 0);
+            total += 1;
+            n++;
+        }
+        if (i == count) break;
+        struct z_rec r = Z_RECS()[i];
+        r.score *= age;
+        if (r.score < 1) continue;
+        total += r.score;
+        recs[n++] = r;
+    }
+    char *pool_out = (char *)(recs + n), *p = pool_out;
+    for (uint32_t i = 0, k = 0; i < n; i++) {
+        const char *src;
+        if (add && i == at) {
+            src = add;
+        } else {
+            // walk the old records in step, skipping the dropped ones
+            while (Z_RECS()[k].score * age < 1) k++;
+            src = Z_PATH(&Z_RECS()[k++]);
+        }
+        recs[i].path_off = (uint32_t)(p - pool_out);
+        memcpy(p, src, recs[i].path_len + 1u);
+        p += recs[i].path_len + 1;
+    }
+
+    struct z_header *h = (struct z_header *)buf;
+    memcpy(h->magic, Z_MAGIC, 4);
+    h->count = n;
+    h->pool_len = (uint32_t)(p - pool_out);
+    h->total = total;
+
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d", zdb.file, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        write_all(fd, buf, (size_t)(p - buf));
+        close(fd);
+        if (rename(tmp, zdb.file) < 0) unlink(tmp);
+    }
+    free(buf);
+    z_sync();
+}
+
+/* record a visit to an absolute directory path */
+static void z_visit(const char *path) {
+    const char *b = strrchr(path, '/');
+    const char *base = b && b[1] ? b + 1 : path;
+    uint32_t now = (uint32_t)time(NULL);
+
+    if (strlen(path) >= UINT16_MAX || (!z_sync() && !zdb.file[0])) return;
+
+    size_t i = z_lower_bound(base, path);
+    if (zdb.map && i < Z_HDR()->count &&
+        z_cmp(base, path, &Z_RECS()[i]) == 0) {
+        struct z_rec *r = &Z_RECS()[i];
+        r->score += 1;
+        r->last = now;
+        Z_HDR()->total += 1;
+        if (Z_HDR()->total > Z_MAX_TOTAL) z_rewrite(0, NULL, now, 0.9f);
+        return;
+    }
+    z_rewrite(i, path, now, 1.0f);
+}
+
+static float z_frecency(const struct z_rec *r, uint32_t now) {
+    uint32_t dt = now - r->last;
+    if (dt < 3600)   return r->score * 4;
+    if (dt < 86400)  return r->score * 2;
+    if (dt < 604800) return r->score / 2;
+    return r->score / 4;
+}
+
+static bool z_contains_all(const char *path, char **words, int n) {
+    for (int i = 0; i < n; i++)
+        if (!strcasestr(path, words[i])) return false;
+    return true;
+}
+
+/* best directory for the words; the last one is matched against the
+ * basename, the others anywhere in the path */
+static const char *z_best(char **words, int n) {
+    uint32_t now = (uint32_t)time(NULL);
+    const struct z_rec *best = NULL;
+    float best_score = 0;
+
+    if (!z_sync()) return NULL;
+    const char *last = words[n - 1];
+    size_t plen = strlen(last), count = Z_HDR()->count;
+
+    for (size_t i = z_lower_bound(last, ""); i < count; i++) {
+        const struct z_rec *r = &Z_RECS()[i];
+        if (strncasecmp(Z_BASE(r), last, plen) != 0) break;
+        if (!z_contains_all(Z_PATH(r), words, n - 1)) continue;
+        if (z_frecency(r, now) > best_score) {
+            best = r;
+            best_score = z_frecency(r, now);
+        }
+    }
+    if (!best) {
+        for (size_t i = 0; i < count; i++) {
+            const struct z_rec *r = &Z_RECS()[i];
+            if (z_contains_all(Z_PATH(r), words, n) &&
+                z_frecency(r, now) > best_score) {
+                best = r;
+                best_score = z_frecency(r, now);
+            }
+        }
+    }
+    return best ? Z_PATH(best) : NULL;
+}
+
+struct z_ranked {
+    float       score;
+    const char *path;
+};
+
+static int cmp_z_ranked(const void *a, const void *b) {
+    const struct z_ranked *x = a, *y = b;
+    return (x->score < y->score) - (x->score > y->score);
+}
+
+/* every known directory, best first */
+static void z_list(void) {
+    uint32_t now = (uint32_t)time(NULL);
+
+    if (!z_sync()) return;
+    size_t n = Z_HDR()->count;
+    struct z_ranked *v = malloc((n ? n : 1) * sizeof(*v));
+    for (size_t i = 0; i < n; i++)
+        v[i] = (struct z_ranked){ z_frecency(&Z_RECS()[i], now),
+                                  Z_PATH(&Z_RECS()[i]) };
+    qsort(v, n, sizeof(*v), cmp_z_ranked);
+    for (size_t i = 0; i < n; i++) out_printf("%10.1f  %s\n", v[i].score, v[i].path);
+    free(v);
+}
+
+/* ---- directories ----
+ * cd, the pushd/popd stack and CDPATH. CDPATH hits are cached per
+ * relative name as the index of the first absolute CDPATH entry that
+ * holds it, so a repeated `cd name` is a single chdir(). Misses are not
+ * cached, since the directory may be created at any time. Relative
+ * entries ("", ".") depend on the cwd and are always tried live. The
+ * cache is dropped whenever CDPATH changes, and an entry whose chdir
+ * fails is looked up again from the first entry. */
+
+#define DIRSTACK_MAX 64
+#define CDPATH_SLOTS 256
+
+static char *dir_stack[DIRSTACK_MAX];   // [0] is the most recent push
+static int   dir_depth;
+
+struct cdpath_slot {
+    char *name;
+    int   hit;                  // CDPATH index holding name
+};
+
+static struct cdpath_slot cdpath_cache[CDPATH_SLOTS];
+static char *cdpath_value;      // CDPATH the cache belongs to
+
+/* CDPATH entry i with ~ expanded into buf; false past the end */
+static bool cdpath_entry(const char *cdpath, int i, char *buf, size_t n) {
+    const char *p = cdpath;
+
+    for (; i > 0; i--) {
+        p = strchr(p, ':');
+        if (!p) return false;
+        p++;
+    }
+    size_t len = strcspn(p, ":");
+    const char *home = getenv("HOME");
+    if (p[0] == '~' && (len == 1 || p[1] == '/') && home)
+        snprintf(buf, n, "%s%.*s", home, (int)len - 1, p + 1);
+    else
+        snprintf(buf, n, "%.*s", (int)len, p);
+    return true;
+}
+
+/* first absolute CDPATH entry holding directory name, or -1 */
+static int cdpath_scan(const char *cdpath, const char *name) {
+    char dir[PATH_MAX], full[PATH_MAX * 2];
+    struct stat st;
+
+    for (int i = 0; cdpath_entry(cdpath, i, dir, sizeof(dir)); i++) {
+        if (dir[0] != '/') continue;
+        snprintf(full, sizeof(full), "%s/%s", dir, name);
+        if (stat(full, &st) == 0 && S_ISDIR(st.st_mode)) return i;
+    }
+    return -1;
+}
+
+/* CDPATH index holding name, or -1; rescan ignores what is cached */
+static int cdpath_lookup(const char *cdpath, const char *name, bool rescan) {
+    if (!cdpath_value || strcmp(cdpath, cdpath_value) != 0) {
+        for (int i = 0; i < CDPATH_SLOTS; i++) {
+            free(cdpath_cache[i].name);
+            cdpath_cache[i].name = NULL;
+        }
+        free(cdpath_value);
+        cdpath_value = strdup(cdpath);
+    }
+    struct cdpath_slot *s =
+        &cdpath_cache[hash_bytes(name, strlen(name)) % CDPATH_SLOTS];
+    if (rescan || !s->name || strcmp(s->name, name) != 0) {
+        free(s->name);
+        s->name = NULL;
+        int hit = cdpath_scan(cdpath, name);
+        if (hit < 0) return -1;
+        s->name = strdup(name);
+        s->hit = hit;
+    }
+    return s->hit;
+}
+
+/* chdir through CDPATH; 1 if a CDPATH entry was used, 0 if the name was
+ * taken as is, -1 on failure */
+static int cdpath_chdir(const char *name) {
+    const char *cdpath = getenv("CDPATH");
+    char dir[PATH_MAX], full[PATH_MAX * 2];
+
+    if (!cdpath || !*cdpath || name[0] == '/' ||
+        !strcmp(name, ".") || !strcmp(name, "..") ||
+        !strncmp(name, "./", 2) || !strncmp(name, "../", 3))
+        return chdir(name) == 0 ? 0 : -1;
+
+    int hit = cdpath_lookup(cdpath, name, false);
+    bool rescanned = false;
+    for (int i = 0; cdpath_entry(cdpath, i, dir, sizeof(dir)); i++) {
+        if (dir[0] == '/' && i != hit) continue;
+        snprintf(full, sizeof(full), "%s%s%s", dir, *dir ? "/" : "", name);
+        if (chdir(full) == 0) return strcmp(dir, ".") && *dir ? 1 : 0;
+        if (i == hit && !rescanned) {
+            // the cached directory went away; look again from the start
+            hit = cdpath_lookup(cdpath, name, true);
+            rescanned = true;
+            i = -1;
+        }
+    }
+    return chdir(name) == 0 ? 0 : -1;
+}
+
+/* change directory, keep PWD/OLDPWD, record the visit; -1 on failure */
+static int change_dir(const char *target, const char *who) {
+    char old[PATH_MAX], cwd[PATH_MAX];
+    bool show = false;
+
+    if (!getcwd(old, sizeof(old))) old[0] = '\0';
+    if (!target) target = getenv("HOME");
+    if (!target) target = ".";
+    if (strcmp(target, "-") == 0) {
+        target = getenv("OLDPWD");
+        if (!target) {
+            fprintf(stderr, "%s: OLDPWD not set\n", who);
+            return -1;
+        }
+        show = true;
+    }
+
+    int r = cdpath_chdir(target);
+    if (r < 0) {
+        fprintf(stderr, "%s: %s: %s\n", who, target, strerror(errno));
+        return -1;
+    }
+    if (!getcwd(cwd, sizeof(cwd))) return 0;
+    if (r == 1 || show) out_printf("%s\n", cwd);
+    if (old[0]) setenv("OLDPWD", old, 1);
+    setenv("PWD", cwd, 1);
+    if (interactive) z_visit(cwd);
+    return 0;
+}
+
+static void dirs_print(bool verbose) {
+    char cwd[PATH_MAX];
+
+    if (!getcwd(cwd, sizeof(cwd))) snprintf(cwd, sizeof(cwd), ".");
+    if (verbose) {
+        out_printf(" 0  %s\n", cwd);
+        for (int i = 0; i < dir_depth; i++)
+            out_printf("%2d  %s\n", i + 1, dir_stack[i]);
+        return;
+    }
+    out_str(cwd);
+    for (int i = 0; i < dir_depth; i++) out_printf(" %s", dir_stack[i]);
+    out_put("\n", 1);
+}
+
+/* pushd [DIR | +N] */
+static int dirs_push(int argc, char **argv) {
+    char cwd[PATH_MAX];
+
+    if (!getcwd(cwd, sizeof(cwd))) {
+        perror("pushd");
+        return -1;
+    }
+    if (argc > 1 && argv[1][0] == '+') {
+        // rotate so that entry N (0 = cwd) becomes the cwd
+        int n = atoi(argv[1] + 1);
+        if (n < 1 || n > dir_depth) {
+            fprintf(stderr, "pushd: %s: directory stack index out of range\n",
+                    argv[1]);
+            return -1;
+        }
+        char *all[DIRSTACK_MAX + 1];
+        all[0] = strdup(cwd);
+        memcpy(all + 1, dir_stack, (size_t)dir_depth * sizeof(*all));
+        if (change_dir(all[n], "pushd") < 0) {
+            free(all[0]);
+            return -1;
+        }
+        for (int i = 0; i < dir_depth; i++)
+            dir_stack[i] = all[(n + 1 + i) % (dir_depth + 1)];
+        free(all[n]);
+        dirs_print(false);
+        return 0;
+    }
+
+    if (dir_depth == DIRSTACK_MAX) {
+        fprintf(stderr, "pushd: directory stack full\n");
+        return -1;
+    }
+    const char *target;
+    if (argc > 1) {
+        target = argv[1];
+    } else if (dir_depth) {
+        target = dir_stack[0];      // swap the top two
+    } else {
+        fprintf(stderr, "pushd: no other directory\n");
+        return -1;
+    }
+    char *to = strdup(target);
+    if (change_dir(to, "pushd") < 0) {
+        free(to);
+        return -1;
+    }
+    if (argc > 1) {
+        memmove(dir_stack + 1, dir_stack, (size_t)dir_depth * sizeof(*dir_stack));
+        dir_depth++;
+    } else {
+        free(dir_stack[0]);
+    }
+    dir_stack[0] = strdup(cwd);
+    free(to);
+    dirs_print(false);
+    return 0;
+}
+
+/* popd [+N] */
+static int dirs_pop(int argc, char **argv) {
+    int n = 0;
+
+    if (!dir_depth) {
+        fprintf(stderr, "popd: directory stack empty\n");
+        return -1;
+    }
+    if (argc > 1 && argv[1][0] == '+') {
+        n = atoi(argv[1] + 1);
+        if (n < 1 || n > dir_depth) {
+            fprintf(stderr, "popd: %s: directory stack index out of range\n",
+                    argv[1]);
+            return -1;
+        }
+        n--;                        // +N names dir_stack[N - 1]
+    } else if (change_dir(dir_stack[0], "popd") < 0) {
+        return -1;
+    }
+    free(dir_stack[n]);
+    memmove(dir_stack + n, dir_stack + n + 1,
+            (size_t)(dir_depth - n - 1) * sizeof(*dir_stack));
+    dir_depth--;
+    dirs_print(false);
+    return 0;
+}
+
+/* ---- records ----
+ * With --records FD[:json|:bin] the shell writes a result record for
+ * every command it runs to FD: the command, pid (0 for a builtin, which
+ * runs in the shell), exit status or signal, whether the 10-second
+ * timeout killed it, wall time and rusage. Records are queued in memory
+ * and written in batches to the fd, made non-blocking, at each prompt or
+ * when 4K have built up, so a slow reader never stalls the shell. When
+ * it falls 1M behind, new records are dropped and counted, and the next
+ * one that fits says how many. A forked copy of the shell starts its own
+ * queue. */
+
+#define REC_BATCH 4096
+#define REC_MAX   (1 << 20)
+#define REC_TIMED_OUT 1
+#define REC_BUILTIN   2
+
+/* --records FD:bin, native byte order */
+struct rec_bin {
+    uint32_t size;                  // sizeof(struct rec_bin)
+    uint32_t pid;
+    int32_t  status;                // exit status, or 128 + signal
+    int32_t  signal;                // 0 if it exited
+    uint32_t flags;                 // REC_*
+    uint32_t dropped;               // records lost just before this one
+    uint64_t wall_us, utime_us, stime_us, maxrss_kb;
+    char     cmd[64];               // NUL-padded, cut if longer
+};
+
+static struct {
+    int           fd;               // -1: off
+    bool          bin;
+    pid_t         owner;            // the process whose queue buf is
+    struct strbuf buf;
+    size_t        off;              // written so far
+    uint32_t      dropped;
+} rec = { .fd = -1 };
+
+static void json_put_string(struct strbuf *b, const char *s, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+
+    sb_put(b, "\"", 1);
+    for (size_t i = 0; i < n; ) {
+        size_t j = i;
+        while (j < n && (unsigned char)s[j] >= 0x20 && s[j] != '"' && s[j] != '\\') j++;
+        sb_put(b, s + i, j - i);
+        if (j == n) break;
+        char e[7] = { '\\', s[j], 0 };
+        const char *m = strchr("\nn\rr\tt\bb\ff", s[j]);
+        if (s[j] == '"' || s[j] == '\\') sb_put(b, e, 2);
+        else if (m && s[j]) { e[1] = m[1]; sb_put(b, e, 2); }
+        else {
+            unsigned char c = (unsigned char)s[j];
+            char u[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+            sb_put(b, u, 6);
+        }
+        i = j + 1;
+    }
+    sb_put(b, "\"", 1);
+}
+
+static double ms_between(const struct timespec *a, const struct timespec *b) {
+    return (double)(b->tv_sec - a->tv_sec) * 1e3 + (double)(b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+static int rec_open(const char *spec) {
+    char *end;
+    long fd = strtol(spec, &end, 10);
+
+    if (end == spec || fd < 0 || fd > INT_MAX ||
+        (*end && strcmp(end, ":json") != 0 && strcmp(end, ":bin") != 0)) {
+        fprintf(stderr, "--records: %s: want FD, FD:json or FD:bin\n", spec);
+        return -1;
+    }
+    int fl = fcntl((int)fd, F_GETFL);
+    if (fl < 0 || fcntl((int)fd, F_SETFL, fl | O_NONBLOCK) < 0) {
+        fprintf(stderr, "--records: %ld: %s\n", fd, strerror(errno));
+        return -1;
+    }
+    fcntl((int)fd, F_SETFD, FD_CLOEXEC);    // for the shell, not its commands
+    rec.fd = (int)fd;
+    rec.bin = strcmp(end, ":bin") == 0;
+    rec.owner = getpid();
+    return 0;
+}
+
+/* write what is queued; final waits up to a second for a slow reader */
+static void rec_flush(bool final) {
+    while (rec.fd >= 0 && rec.off < rec.buf.len && rec.owner == getpid()) {
+        ssize_t r = write(rec.fd, rec.buf.p + rec.off, rec.buf.len - rec.off);
+        if (r > 0) {
+            rec.off += (size_t)r;
+            continue;
+        }
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && errno == EAGAIN && final) {
+            struct pollfd p = { rec.fd, POLLOUT, 0 };
+            if (poll(&p, 1, 1000) > 0) continue;
+        } else if (r < 0 && errno != EAGAIN) {
+            rec.fd = -1;            // the reader is gone
+        }
+        break;
+    }
+    if (rec.off == rec.buf.len) rec.off = rec.buf.len = 0;
+}
+
+static void rec_final(void) {
+    rec_flush(true);
+}
+
+#define REC_CMD_MAX 256
+
+/* argv as one line, cut at REC_CMD_MAX - 1 */
+static void rec_cmd(char *const argv[], char *cmd) {
+    size_t at = 0;
+
+    cmd[0] = '\0';
+    for (int k = 0; argv[k] && at < REC_CMD_MAX - 1; k++)
+        at += (size_t)snprintf(cmd + at, REC_CMD_MAX - at, k ? " %s" : "%s", argv[k]);
+}
+
+/* one record; wstatus as from wait(), ru NULL for none */
+static void rec_add(const char *cmd, pid_t pid, int wstatus, unsigned flags,
+                    const struct timespec *start, const struct rusage *ru) {
+    struct timespec now;
+    struct rusage none = { 0 };
+    size_t at = strlen(cmd);
+
+    if (rec.fd < 0) return;
+    if (rec.owner != getpid()) {    // a fork: the queue is the parent's
+        rec.owner = getpid();
+        rec.buf.len = rec.off = 0;
+        rec.dropped = 0;
+    }
+    if (rec.buf.len - rec.off > REC_MAX) rec_flush(false);
+    if (rec.buf.len - rec.off > REC_MAX) {
+        rec.dropped++;
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!ru) ru = &none;
+
+    bool sig = WIFSIGNALED(wstatus);
+    int status = sig ? 128 + WTERMSIG(wstatus) : WEXITSTATUS(wstatus);
+    uint64_t wall = (uint64_t)(ms_between(start, &now) * 1e3);
+    uint64_t ut = (uint64_t)ru->ru_utime.tv_sec * 1000000 + (uint64_t)ru->ru_utime.tv_usec;
+    uint64_t st = (uint64_t)ru->ru_stime.tv_sec * 1000000 + (uint64_t)ru->ru_stime.tv_usec;
+    if (rec.bin) {
+        struct rec_bin b = {
+            .size = sizeof(b), .pid = (uint32_t)pid, .status = status,
+            .signal = sig ? WTERMSIG(wstatus) : 0, .flags = flags,
+            .dropped = rec.dropped, .wall_us = wall, .utime_us = ut,
+            .stime_us = st, .maxrss_kb = (uint64_t)ru->ru_maxrss,
+        };
+        memcpy(b.cmd, cmd, at < sizeof(b.cmd) ? at : sizeof(b.cmd));
+        sb_put(&rec.buf, (const char *)&b, sizeof(b));
+    } else {
+        char num[320];
+        sb_put(&rec.buf, "{\"cmd\":", 7);
+        json_put_string(&rec.buf, cmd, at);
+        int n = snprintf(num, sizeof(num),
+            ",\"pid\":%d,\"status\":%d,\"signal\":%d,\"timed_out\":%s,"
+            "\"builtin\":%s,\"wall_us\":%llu,\"utime_us\":%llu,\"stime_us\":%llu,"
+            "\"maxrss_kb\":%ld",
+            (int)pid, status, sig ? WTERMSIG(wstatus) : 0,
+            flags & REC_TIMED_OUT ? "true" : "false",
+            flags & REC_BUILTIN ? "true" : "false",
+            (unsigned long long)wall, (unsigned long long)ut,
+            (unsigned long long)st, ru->ru_maxrss);
+        sb_put(&rec.buf, num, (size_t)n);
+        if (rec.dropped) {
+            n = snprintf(num, sizeof(num), ",\"dropped\":%u", rec.dropped);
+            sb_put(&rec.buf, num, (size_t)n);
+        }
+        sb_put(&rec.buf, "}\n", 2);
+    }
+    rec.dropped = 0;
+    if (rec.buf.len - rec.off >= REC_BATCH) rec_flush(false);
+}
+
+/* CPU a builtin took on this thread since *before */
+static void rusage_since(const struct rusage *before, struct rusage *ru) {
+    getrusage(RUSAGE_THREAD, ru);
+    timersub(&ru->ru_utime, &before->ru_utime, &ru->ru_utime);
+    timersub(&ru->ru_stime, &before->ru_stime, &ru->ru_stime);
+}
+
+/* ---- cgroups ----
+ * With `cgroup on`, every job is started in a cgroup v2 leaf of its own
+ * under the cgroup the shell was started in, with the limits set
+ * through `cgroup KEY=VALUE` written into the leaf first. A delegated
+ * subtree is enough: the shell moves itself into a "shell" leaf, since
+ * a cgroup with processes cannot hand controllers down, then enables
+ * them for its children. Children that only exec are created in their
+ * leaf by clone3(CLONE_INTO_CGROUP); the rest fork and move themselves.
+ * At reap the leaf's memory.peak and cpu.stat are read and it is
+ * removed. A leaf that still holds strays is left behind. */
+
+static const char *cg_keys[] = {
+    "cpu.max", "cpu.weight", "memory.high", "memory.max", "memory.swap.max",
+    "pids.max", NULL
+};
+
+#define NCG_KEYS (sizeof(cg_keys) / sizeof(cg_keys[0]) - 1)
+
+static struct {
+    bool     on, ready;
+    bool     no_clone3;             // the kernel refused it once
+    int      dir;                   // the cgroup we started in
+    char     path[PATH_MAX];
+    unsigned seq;
+    char    *values[NCG_KEYS];      // per key, NULL = the kernel's default
+    char     last[96];              // report on the last foreground job
+} cg = { .dir = -1 };
+
+/* a leaf being started: its directory and name number */
+struct cg_leaf {
+    int      fd;
+    unsigned id;
+};
+
+static int cg_write(int dir, const char *file, const char *value) {
+    int fd = openat(dir, file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t r = write(fd, value, strlen(value));
+    int err = errno;
+    close(fd);
+    errno = err;
+    return r < 0 ? -1 : 0;
+}
+
+static ssize_t cg_read(int dir, const char *file, char *buf, size_t n) {
+    int fd = openat(dir, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t r = read(fd, buf, n - 1);
+    close(fd);
+    if (r >= 0) buf[r] = '\0';
+    return r;
+}
+
+/* where cgroup2 is mounted and which cgroup we are in; -1 if none */
+static int cg_locate(char *path, size_t n) {
+    char line[PATH_MAX + 256], mnt[PATH_MAX] = "";
+    FILE *f = fopen("/proc/self/mountinfo", "re");
+
+    if (!f) return -1;
+    while (fgets(line, sizeof(line), f)) {
+        // ID PARENT MAJ:MIN ROOT MOUNTPOINT OPTIONS... - TYPE SOURCE ...
+        char *sep = strstr(line, " - cgroup2 ");
+        if (!sep) continue;
+        if (sscanf(line, "%*s %*s %*s %*s %4095s", mnt) == 1) break;
+    }
+    fclose(f);
+    if (!*mnt || !(f = fopen("/proc/self/cgroup", "re"))) return -1;
+    int r = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) != 0) continue;
+        line[strcspn(line, "\n")] = '\0';
+        // a root-level cgroup is "/"; keep the path free of "//"
+        if ((size_t)snprintf(path, n, "%s%s", mnt,
+                             strcmp(line + 3, "/") ? line + 3 : "") < n)
+            r = 0;
+        break;
+    }
+    fclose(f);
+    return r;
+}
+
+/* once: move into the "shell" leaf and open the controllers */
+static int cg_setup(void) {
+    static const char *controllers[] = { "+cpu", "+memory", "+pids", NULL };
+    char pid[24];
+
+    if (cg.ready) return 0;
+    if (cg_locate(cg.path, sizeof(cg.path)) < 0) {
+        fprintf(stderr, "cgroup: no cgroup v2 hierarchy\n");
+        return -1;
+    }
+    cg.dir = open(cg.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cg.dir < 0) {
+        fprintf(stderr, "cgroup: %s: %s\n", cg.path, strerror(errno));
+        return -1;
+    }
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    if ((mkdirat(cg.dir, "shell", 0755) < 0 && errno != EEXIST) ||
+        cg_write(cg.dir, "shell/cgroup.procs", pid) < 0) {
+        fprintf(stderr, "cgroup: %s/shell: %s\n", cg.path, strerror(errno));
+        close(cg.dir);
+        cg.dir = -1;
+        return -1;
+    }
+    // what the launcher starts begins where it is, so it comes along
+    snprintf(pid, sizeof(pid), "%d", (int)launcher.pid);
+    if (launcher.pid > 0 && cg_write(cg.dir, "shell/cgroup.procs", pid) < 0)
+        fprintf(stderr, "cgroup: launcher: %s\n", strerror(errno));
+    // one at a time: a controller missing here should not cost the others
+    for (const char **c = controllers; *c; c++)
+        if (cg_write(cg.dir, "cgroup.subtree_control", *c) < 0 && interactive)
+            fprintf(stderr, "cgroup: %s: %s\n", *c + 1, strerror(errno));
+    cg.ready = true;
+    return 0;
+}
+
+/* a new leaf with the limits in it; fd -1 when cgroups are off or the
+ * leaf could not be made, and the job runs where the shell is */
+static struct cg_leaf cg_start(void) {
+    struct cg_leaf l = { -1, 0 };
+    char name[48];
+
+    if (!cg.on || cg_setup() < 0) return l;
+    unsigned id = ++cg.seq;
+    snprintf(name, sizeof(name), "job-%d.%u", (int)getpid(), id);
+    if (mkdirat(cg.dir, name, 0755) < 0) {
+        fprintf(stderr, "cgroup: %s: %s\n", name, strerror(errno));
+        return l;
+    }
+    int fd = openat(cg.dir, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (size_t k = 0; fd >= 0 && k < NCG_KEYS; k++) {
+        if (cg.values[k] && cg_write(fd, cg_keys[k], cg.values[k]) < 0) {
+            fprintf(stderr, "cgroup: %s: %s\n", cg_keys[k], strerror(errno));
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) {
+        unlinkat(cg.dir, name, AT_REMOVEDIR);
+        return l;
+    }
+    l.fd = fd;
+    l.id = id;
+    return l;
+}
+
+/* the parent is done handing the leaf out */
+static void cg_started(struct cg_leaf *l) {
+    if (l->fd >= 0) close(l->fd);
+    l->fd = -1;
+}
+
+/* fork into leaf l. clone3 bypasses glibc's fork handlers, so it is
+ * only used when the child does nothing but exec. */
+static pid_t cg_fork(const struct cg_leaf *l, bool exec_only) {
+    pid_t pid;
+
+    if (l->fd >= 0 && exec_only && !cg.no_clone3) {
+        struct clone_args a = {
+            .flags = CLONE_INTO_CGROUP,
+            .exit_signal = SIGCHLD,
+            .cgroup = (uint64_t)l->fd,
+        };
+        pid = (pid_t)syscall(SYS_clone3, &a, sizeof(a));
+        if (pid == 0) cg.on = false;    // whatever it starts stays with it
+        if (pid >= 0) return pid;
+        if (errno == ENOSYS || errno == E2BIG || errno == EINVAL)
+            cg.no_clone3 = true;
+    }
+    pid = fork();
+    if (pid == 0) {
+        cg.on = false;
+        if (l->fd >= 0 && cg_write(l->fd, "cgroup.procs", "0") < 0) {
+            fprintf(stderr, "cgroup: %s\n", strerror(errno));
+            _exit(126);             // not unconfined, then
+        }
+    }
+    return pid;
+}
+
+/* read leaf id's usage into report and remove it */
+static void cg_finish(unsigned id, char *report, size_t n) {
+    char name[48], buf[512];
+    int at = 0;
+
+    snprintf(name, sizeof(name), "job-%d.%u", (int)getpid(), id);
+    int fd = openat(cg.dir, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    if (cg_read(fd, "memory.peak", buf, sizeof(buf)) > 0)
+        at += snprintf(report + at, n - at, "peak %.1fM",
+                       strtoull(buf, NULL, 10) / 1048576.0);
+    char *u;
+    if (cg_read(fd, "cpu.stat", buf, sizeof(buf)) > 0 &&
+        (u = strstr(buf, "usage_usec ")) && (size_t)at < n)
+        snprintf(report + at, n - at, "%scpu %.3fs", at ? ", " : "",
+                 strtoull(u + 11, NULL, 10) / 1e6);
+    close(fd);
+    unlinkat(cg.dir, name, AT_REMOVEDIR);
+}
+
+/* cgroup [on|off] [KEY=VALUE|KEY=]... ; bare: the settings */
+static int cgroup_run(int argc, char **argv) {
+    int status = 0;
+
+    if (argc == 1) {
+        out_printf("cgroup %s%s%s\n", cg.on ? "on" : "off",
+                   cg.ready ? "  " : "", cg.ready ? cg.path : "");
+        for (size_t k = 0; k < NCG_KEYS; k++)
+            if (cg.values[k]) out_printf("%s=%s\n", cg_keys[k], cg.values[k]);
+        if (*cg.last) out_printf("last: %s\n", cg.last);
+        return 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "on") == 0) {
+            if (cg_setup() < 0) return 1;
+            cg.on = true;
+            continue;
+        }
+        if (strcmp(argv[i], "off") == 0) {
+            cg.on = false;
+            continue;
+        }
+        char *eq = strchr(argv[i], '=');
+        size_t k = 0;
+        if (eq) {
+            *eq = '\0';
+            while (k < NCG_KEYS && strcmp(cg_keys[k], argv[i]) != 0) k++;
+        }
+        if (!eq || k == NCG_KEYS) {
+            fprintf(stderr, "cgroup: %s: unknown setting\n", argv[i]);
+            status = 2;
+            continue;
+        }
+        // the kernel checks the value when a leaf is made
+        free(cg.values[k]);
+        cg.values[k] = eq[1] ? strdup(eq + 1) : NULL;
+    }
+    return status;
+}
+
+/* ---- jobs ---- */
+
+#define MAX_JOBS 64
+
+struct job {
+    int      id;                    // 0 = free slot
+    pid_t    pid;
+    unsigned cg;                    // its cgroup leaf, 0 = none
+    struct timespec started;
+    char     cmd[128];
+};
+
+static struct job jobs[MAX_JOBS];
+
+static struct job *job_add(pid_t pid, char *const argv[]) {
+    int id = 1;
+
+    for (int i = 0; i < MAX_JOBS; i++)
+        if (jobs[i].id >= id) id = jobs[i].id + 1;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct job *j = &jobs[i];
+        if (j->id) continue;
+        j->id = id;
+        j->pid = pid;
+        j->cg = 0;
+        clock_gettime(CLOCK_MONOTONIC, &j->started);
+        size_t at = 0;
+        for (int k = 0; argv[k] && at < sizeof(j->cmd) - 1; k++)
+            at += (size_t)snprintf(j->cmd + at, sizeof(j->cmd) - at,
+                                   k ? " %s" : "%s", argv[k]);
+        return j;
+    }
+    return NULL;                    // table full: run untracked
+}
+
+static struct job *job_find(int id) {
+    for (int i = 0; i < MAX_JOBS; i++)
+        if (id && jobs[i].id == id) return &jobs[i];
+    return NULL;
+}
+
+static int jobs_count(void) {
+    int n = 0;
+    for (int i = 0; i < MAX_JOBS; i++)
+        if (jobs[i].id) n++;
+    return n;
+}
+
+/* collect finished background jobs and report them */
+static void jobs_reap(void) {
+    int status;
+    char usage[96];
+
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct job *j = &jobs[i];
+        struct rusage ru;
+        if (!j->id || wait4(j->pid, &status, WNOHANG, &ru) <= 0) continue;
+        rec_add(j->cmd, j->pid, status, 0, &j->started, &ru);
+        *usage = '\0';
+        if (j->cg) cg_finish(j->cg, usage, sizeof(usage));
+        if (WIFSIGNALED(status))
+            out_printf("[%d] killed (%s)  %s", j->id,
+                       strsignal(WTERMSIG(status)), j->cmd);
+        else if (WEXITSTATUS(status))
+            out_printf("[%d] exit %d  %s", j->id, WEXITSTATUS(status), j->cmd);
+        else
+            out_printf("[%d] done  %s", j->id, j->cmd);
+        out_printf(*usage ? "  (%s)\n" : "\n", usage);
+        j->id = 0;
+    }
+}
+
+/* ---- limits ----
+ * `ulimit` keeps the limits in a table rather than setting them on the
+ * shell, and every child applies the table between fork and exec, so a
+ * limit can be raised again later. `prlimit` changes a running job's
+ * own process, by job id. */
+
+struct limit {
+    char        opt;
+    int         resource;
+    rlim_t      unit;               // bytes per displayed unit
+    const char *name;
+};
+
+static const struct limit limits[] = {
+    { 'c', RLIMIT_CORE,   512,  "core file size (blocks)" },
+    { 'n', RLIMIT_NOFILE, 1,    "open files" },
+    { 't', RLIMIT_CPU,    1,    "cpu time (seconds)" },
+    { 'u', RLIMIT_NPROC,  1,    "max user processes" },
+    { 'v', RLIMIT_AS,     1024, "virtual memory (kbytes)" },
+};
+
+#define NLIMITS (sizeof(limits) / sizeof(limits[0]))
+
+static struct {
+    bool          set;
+    struct rlimit r;
+} limit_set[NLIMITS];
+
+static int limit_index(char opt) {
+    for (size_t i = 0; i < NLIMITS; i++)
+        if (limits[i].opt == opt) return (int)i;
+    return -1;
+}
+
+/* what children get: ulimit's, else the shell's own */
+static void limits_get(size_t i, struct rlimit *r) {
+    if (limit_set[i].set)
+        *r = limit_set[i].r;
+    else
+        getrlimit(limits[i].resource, r);
+}
+
+/* in a child, before exec; -1 if a limit could not be set */
+static int limits_apply(void) {
+    for (size_t i = 0; i < NLIMITS; i++) {
+        if (!limit_set[i].set) continue;
+        if (setrlimit(limits[i].resource, &limit_set[i].r) < 0) {
+            fprintf(stderr, "ulimit: %s: %s\n", limits[i].name, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static bool limit_parse(const char *s, rlim_t unit, rlim_t *v) {
+    if (strcmp(s, "unlimited") == 0) {
+        *v = RLIM_INFINITY;
+        return true;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (errno || end == s || *end || *s == '-' || n > RLIM_INFINITY / unit - 1)
+        return false;
+    *v = (rlim_t)n * unit;
+    return true;
+}
+
+static void limit_print(size_t i, rlim_t v, bool named) {
+    if (named) out_printf("%-26s(-%c) ", limits[i].name, limits[i].opt);
+    if (v == RLIM_INFINITY)
+        out_printf("unlimited\n");
+    else
+        out_printf("%llu\n", (unsigned long long)(v / limits[i].unit));
+}
+
+static bool prlimit_get(size_t i, struct rlimit *r, void *ctx);
+
+/* shared by ulimit and prlimit: [-H|-S] [-a] [-c|-n|-t|-u|-v [VALUE]]...;
+ * get and set read or change one limit; 0, or an exit status */
+static int limits_run(const char *who, int argc, char **argv,
+                      bool (*get)(size_t, struct rlimit *, void *),
+                      bool (*set)(size_t, bool, bool, rlim_t, void *), void *ctx) {
+    bool hard = false, soft = false, any = false;
+    int status = 0;
+
+    for (int i = 0; i < argc; i++) {
+        const char *a = argv[i];
+        if (a[0] != '-' || !a[1] || a[2]) goto usage;
+        if (a[1] == 'H' || a[1] == 'S') {
+            *(a[1] == 'H' ? &hard : &soft) = true;
+            continue;
+        }
+        bool all = a[1] == 'a';
+        int k = all ? -1 : limit_index(a[1]);
+        if (!all && k < 0) goto usage;
+        any = true;
+        if (!all && i + 1 < argc && argv[i + 1][0] != '-') {
+            rlim_t v;
+            if (!limit_parse(argv[++i], limits[k].unit, &v)) {
+                fprintf(stderr, "%s: %s: bad limit\n", who, argv[i]);
+                return 2;
+            }
+            // neither -H nor -S: both, as in sh
+            if (!set((size_t)k, soft || !hard, hard || !soft, v, ctx))
+                status = 1;
+            continue;
+        }
+        for (size_t j = all ? 0 : (size_t)k; j < (all ? NLIMITS : (size_t)k + 1); j++) {
+            struct rlimit r;
+            if (!get(j, &r, ctx)) return 1;
+            limit_print(j, hard ? r.rlim_max : r.rlim_cur, all);
+        }
+    }
+    if (!any) {                     // like -f in sh, with no -f: show all
+        for (size_t j = 0; j < NLIMITS; j++) {
+            struct rlimit r;
+            if (!get(j, &r, ctx)) return 1;
+            limit_print(j, hard ? r.rlim_max : r.rlim_cur, true);
+        }
+    }
+    return status;
+
+usage:
+    fprintf(stderr, "usage: %s%s [-H|-S] [-a] [-c|-n|-t|-u|-v [VALUE|unlimited]]...\n",
+            who, get == prlimit_get ? " JOB" : "");
+    return 2;
+}
+
+static bool ulimit_get(size_t i, struct rlimit *r, void *ctx) {
+    (void)ctx;
+    limits_get(i, r);
+    return true;
+}
+
+static bool ulimit_set(size_t i, bool soft, bool hard, rlim_t v, void *ctx) {
+    struct rlimit r;
+
+    (void)ctx;
+    limits_get(i, &r);
+    if (soft) r.rlim_cur = v;
+    if (hard) r.rlim_max = v;
+    // children could not take it either; say so now rather than at exec
+    struct rlimit own;
+    getrlimit(limits[i].resource, &own);
+    if (r.rlim_cur > r.rlim_max || r.rlim_max > own.rlim_max) {
+        fprintf(stderr, "ulimit: %s: cannot raise limit\n", limits[i].name);
+        return false;
+    }
+    limit_set[i].set = true;
+    limit_set[i].r = r;
+    return true;
+}
+
+static bool prlimit_get(size_t i, struct rlimit *r, void *ctx) {
+    if (prlimit(*(pid_t *)ctx, limits[i].resource, NULL, r) == 0) return true;
+    perror("prlimit");
+    return false;
+}
+
+static bool prlimit_set(size_t i, bool soft, bool hard, rlim_t v, void *ctx) {
+    pid_t pid = *(pid_t *)ctx;
+    struct rlimit r;
+
+    if (!prlimit_get(i, &r, ctx)) return false;
+    if (soft) r.rlim_cur = v;
+    if (hard) r.rlim_max = v;
+    if (prlimit(pid, limits[i].resource, &r, NULL) == 0) return true;
+    fprintf(stderr, "prlimit: %s: %s\n", limits[i].name, strerror(errno));
+    return false;
+}
+
+static int ulimit_run(int argc, char **argv) {
+    return limits_run("ulimit", argc - 1, argv + 1, ulimit_get, ulimit_set, NULL);
+}
+
+/* prlimit %N|N [options]: the job's process only, not what it has
+ * already started */
+static int prlimit_run(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: prlimit JOB [-H|-S] [-a] [-c|-n|-t|-u|-v [VALUE|unlimited]]...\n");
+        return 2;
+    }
+    const char *id = argv[1] + (argv[1][0] == '%');
+    jobs_reap();
+    struct job *j = job_find(atoi(id));
+    if (!j) {
+        fprintf(stderr, "prlimit: %s: no such job\n", argv[1]);
+        return 1;
+    }
+    return limits_run("prlimit", argc - 2, argv + 2, prlimit_get, prlimit_set,
+                      &j->pid);
+}
+
+/* ---- priorities ----
+ * nice, ionice and sched are prefixes. They collect settings and leave
+ * the rest of the line to run as an external command, which takes them
+ * on between fork and exec; no wrapper binary is run. They stack, as in
+ * `nice -n 5 ionice -c idle make`. Bare, each shows the shell's own. */
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+static const char *io_classes[] = { "none", "realtime", "best-effort", "idle" };
+
+struct prio {
+    int nice;                       // increment
+    int ioprio;                     // for ioprio_set, -1 = unchanged
+    int policy;                     // SCHED_*, -1 = unchanged
+};
+
+static bool prio_int(const char *s, int lo, int hi, int *v) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (end == s || *end || n < lo || n > hi) return false;
+    *v = (int)n;
+    return true;
+}
+
+/* the words one prefix at argv takes, 0 if it is not one, -1 if bad */
+static int prio_word(int argc, char **argv, struct prio *p) {
+    int i = 1;
+
+    if (strcmp(argv[0], "nice") == 0) {
+        int n = 10;
+        if (i < argc && strcmp(argv[i], "-n") == 0) {
+            if (i + 1 == argc || !prio_int(argv[i + 1], -40, 40, &n)) goto bad;
+            i += 2;
+        } else if (i < argc && argv[i][0] == '-' &&
+                   argv[i][1] >= '0' && argv[i][1] <= '9') {
+            if (!prio_int(argv[i] + 1, 0, 40, &n)) goto bad;
+            i++;
+        }
+        p->nice += n;
+        return i;
+    }
+    if (strcmp(argv[0], "ionice") == 0) {
+        int class = 2, level = 4;
+        for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+            if (strcmp(argv[i], "-c") == 0) {
+                class = -1;
+                for (int k = 1; k < 4; k++)
+                    if (strcmp(argv[i + 1], io_classes[k]) == 0) class = k;
+                if (class < 0 && !prio_int(argv[i + 1], 1, 3, &class)) goto bad;
+            } else if (strcmp(argv[i], "-n") == 0) {
+                if (!prio_int(argv[i + 1], 0, 7, &level)) goto bad;
+            } else {
+                goto bad;
+            }
+        }
+        p->ioprio = class << IOPRIO_CLASS_SHIFT | (class == 3 ? 0 : level);
+        return i;
+    }
+    if (strcmp(argv[0], "sched") == 0) {
+        if (i == argc) goto bad;
+        if (strcmp(argv[i], "batch") == 0) p->policy = SCHED_BATCH;
+        else if (strcmp(argv[i], "idle") == 0) p->policy = SCHED_IDLE;
+        else if (strcmp(argv[i], "other") == 0) p->policy = SCHED_OTHER;
+        else goto bad;
+        return i + 1;
+    }
+    return 0;
+
+bad:
+    fprintf(stderr, "usage: nice [-n N] | ionice [-c CLASS] [-n 0-7] | "
+                    "sched batch|idle|other  COMMAND...\n");
+    return -1;
+}
+
+/* strip the prefixes from argv into p; the words they took, -1 if bad.
+ * A prefix alone is not one: it is the builtin that shows settings. */
+static int prio_prefix(int argc, char **argv, struct prio *p) {
+    int used = 0, k;
+
+    *p = (struct prio){ 0, -1, -1 };
+    if (argc == 1) return 0;
+    while (used < argc && (k = prio_word(argc - used, argv + used, p)) != 0) {
+        if (k < 0) return -1;
+        used += k;
+    }
+    if (used && used == argc) {
+        fprintf(stderr, "%s: no command\n", argv[0]);
+        return -1;
+    }
+    return used;
+}
+
+/* in a child, before exec */
+static int prio_apply(const struct prio *p) {
+    if (p->policy >= 0) {
+        struct sched_param sp = { 0 };
+        if (sched_setscheduler(0, p->policy, &sp) < 0) {
+            perror("sched");
+            return -1;
+        }
+    }
+    if (p->ioprio >= 0 &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, p->ioprio) < 0) {
+        perror("ionice");
+        return -1;
+    }
+    errno = 0;
+    if (p->nice && nice(p->nice) == -1 && errno) {
+        perror("nice");
+        return -1;
+    }
+    return 0;
+}
+
+/* bare nice, ionice or sched */
+static void prio_show(const char *name) {
+    if (strcmp(name, "nice") == 0) {
+        out_printf("%d\n", getpriority(PRIO_PROCESS, 0));
+    } else if (strcmp(name, "ionice") == 0) {
+        long v = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+        if (v < 0) {
+            perror("ionice");
+            last_status = 1;
+            return;
+        }
+        int class = (int)(v >> IOPRIO_CLASS_SHIFT) & 3;
+        if (class == 3)
+            out_printf("idle\n");
+        else
+            out_printf("%s: prio %ld\n", io_classes[class],
+                       v & ((1 << IOPRIO_CLASS_SHIFT) - 1));
+    } else {
+        int policy = sched_getscheduler(0);
+        out_printf("%s\n", policy == SCHED_BATCH ? "batch"
+                           : policy == SCHED_IDLE ? "idle"
+                           : policy == SCHED_OTHER ? "other" : "realtime");
+    }
+}
+
+/* ---- oom ----
+ * Background jobs start with oom_score_adj raised, so under memory
+ * pressure the kernel picks a batch job before the shell. `job-oom N`
+ * sets it for new jobs, `job-oom JOB N` changes a running one together
+ * with what it has started. Going below the shell's own value needs
+ * CAP_SYS_RESOURCE. */
+
+static int oom_background = 500;
+
+/* pid 0: ourselves */
+static int oom_set(pid_t pid, int adj) {
+    char path[48], val[16];
+
+    if (pid) snprintf(path, sizeof(path), "/proc/%d/oom_score_adj", (int)pid);
+    else snprintf(path, sizeof(path), "/proc/self/oom_score_adj");
+    snprintf(val, sizeof(val), "%d", adj);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t r = write(fd, val, strlen(val));
+    int err = errno;
+    close(fd);
+    errno = err;
+    return r < 0 ? -1 : 0;
+}
+
+static int oom_get(pid_t pid) {
+    char path[48], val[16] = "";
+
+    snprintf(path, sizeof(path), "/proc/%d/oom_score_adj", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return INT_MIN;
+    ssize_t r = read(fd, val, sizeof(val) - 1);
+    close(fd);
+    return r > 0 ? atoi(val) : INT_MIN;
+}
+
+/* pid and, where the kernel lists them, its descendants */
+static int oom_set_tree(pid_t pid, int adj, int depth) {
+    char path[64], buf[1024];
+
+    if (oom_set(pid, adj) < 0) return -1;
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)pid, (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || depth > 16) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    ssize_t r = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    buf[r > 0 ? r : 0] = '\0';
+    for (char *p = buf, *end; *p; p = end) {
+        long child = strtol(p, &end, 10);
+        if (end == p) break;
+        oom_set_tree((pid_t)child, adj, depth + 1);     // it may be gone
+    }
+    return 0;
+}
+
+/* job-oom [N] | job-oom JOB N */
+static int job_oom_run(int argc, char **argv) {
+    int adj;
+
+    if (argc == 1) {
+        out_printf("new jobs: %d\n", oom_background);
+        jobs_reap();
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (!jobs[i].id) continue;
+            int v = oom_get(jobs[i].pid);
+            if (v != INT_MIN)
+                out_printf("[%d] %d  %s\n", jobs[i].id, v, jobs[i].cmd);
+        }
+        return 0;
+    }
+    if (argc == 2 && prio_int(argv[1], -1000, 1000, &adj)) {
+        oom_background = adj;
+        return 0;
+    }
+    if (argc != 3 || !prio_int(argv[2], -1000, 1000, &adj)) {
+        fprintf(stderr, "usage: job-oom [JOB] -1000..1000\n");
+        return 2;
+    }
+    jobs_reap();
+    struct job *j = job_find(atoi(argv[1] + (argv[1][0] == '%')));
+    if (!j) {
+        fprintf(stderr, "job-oom: %s: no such job\n", argv[1]);
+        return 1;
+    }
+    if (oom_set_tree(j->pid, adj, 0) < 0) {
+        fprintf(stderr, "job-oom: %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/* ---- prompt ----
+ * Rendered from the compiled PS1 into one buffer and written with a
+ * single write(); nothing is parsed per prompt. Segments
+ * come from a small per-directory cache and are always shown as cached,
+ * possibly stale; a background task refreshes them and, if that lands
+ * while the user is typing, the editor repaints the prompt in place. */
+
+#define NSEGMENTS 8
+
+struct segments {
+    char cwd[PATH_MAX];
+    char git[64], kube[128];
+    bool pending;                  // refresh task in flight
+    unsigned long used;            // LRU stamp
+};
+
+static struct segments seg_cache[NSEGMENTS];
+static unsigned long   seg_clock;
+
+static char   prompt_buf[PATH_MAX + 256];
+static size_t prompt_len;
+static char   prompt_cwd[PATH_MAX];
+
+static struct segments *seg_find(const char *cwd) {
+    struct segments *victim = &seg_cache[0];
+
+    for (int i = 0; i < NSEGMENTS; i++) {
+        if (strcmp(seg_cache[i].cwd, cwd) == 0) {
+            seg_cache[i].used = ++seg_clock;
+            return &seg_cache[i];
+        }
+        if (seg_cache[i].used < victim->used) victim = &seg_cache[i];
+    }
+    memset(victim, 0, sizeof(*victim));
+    snprintf(victim->cwd, sizeof(victim->cwd), "%s", cwd);
+    victim->used = ++seg_clock;
+    return victim;
+}
+
+static void seg_refresh(struct segments *s) {
+    const char *kc = getenv("KUBECONFIG"), *home = getenv("HOME");
+
+    if (tasks.efd < 0 || s->pending) return;
+    struct task *t = calloc(1, sizeof(*t));
+    t->kind = TASK_PROMPT;
+    snprintf(t->dir, sizeof(t->dir), "%s", s->cwd);
+    if (kc)
+        snprintf(t->arg, sizeof(t->arg), "%.*s", (int)strcspn(kc, ":"), kc);
+    else if (home)
+        snprintf(t->arg, sizeof(t->arg), "%s/.kube/config", home);
+    s->pending = true;
+    task_submit(t);
+}
+
+/* store a finished refresh; true if the prompt on screen is now outdated */
+static bool seg_store(const struct task *t) {
+    struct segments *s = seg_find(t->dir);
+    bool changed = strcmp(s->git, t->git) || strcmp(s->kube, t->kube);
+
+    s->pending = false;
+    memcpy(s->git, t->git, sizeof(s->git));
+    memcpy(s->kube, t->kube, sizeof(s->kube));
+    return changed && strcmp(t->dir, prompt_cwd) == 0;
+}
+
+/* PS1 compiled into segments; recompiled only when the string changes.
+ * Escapes: \w cwd, \W its last component, \u user, \h host, \? last exit
+ * status, \j jobs, \t time, \D last command duration, \g git segment,
+ * \k kube segment, \$ '#' for root else '$', \n, \e, \\. */
+
+enum ps_kind {
+    PS_TEXT, PS_CWD, PS_CWD_BASE, PS_USER, PS_HOST, PS_STATUS, PS_JOBS,
+    PS_TIME, PS_DURATION, PS_GIT, PS_KUBE, PS_DOLLAR
+};
+
+struct ps_seg {
+    enum ps_kind kind;
+    const char  *text;              // PS_TEXT only
+    size_t       len;
+};
+
+#define DEFAULT_PS1 "\\w\\g\\k> "
+
+static char          *ps_source;    // PS1 the segments were built from
+static char          *ps_text;      // literal bytes referenced by segments
+static struct ps_seg *ps_segs;
+static size_t         ps_nsegs;
+static bool           ps_wants_segments;
+
+static struct timespec cmd_started, cmd_finished;
+static bool            continuing;  // reading more lines of a definition
+
+static void ps_compile(const char *src) {
+    size_t cap = 8, tlen = 0;
+
+    free(ps_source);
+    free(ps_text);
+    free(ps_segs);
+    ps_source = strdup(src);
+    ps_text = malloc(strlen(src) + 1);
+    ps_segs = malloc(cap * sizeof(*ps_segs));
+    ps_nsegs = 0;
+    ps_wants_segments = false;
+
+    for (const char *p = src; *p; ) {
+        enum ps_kind kind = PS_TEXT;
+        char lit = *p;
+
+        if (*p == '\\' && p[1]) {
+            switch (p[1]) {
+            case 'w':  kind = PS_CWD;      break;
+            case 'W':  kind = PS_CWD_BASE; break;
+            case 'u':  kind = PS_USER;     break;
+            case 'h':  kind = PS_HOST;     break;
+            case '?':  kind = PS_STATUS;   break;
+            case 'j':  kind = PS_JOBS;     break;
+            case 't':  kind = PS_TIME;     break;
+            case 'D':  kind = PS_DURATION; break;
+            case 'g':  kind = PS_GIT;      break;
+            case 'k':  kind = PS_KUBE;     break;
+            case '$':  kind = PS_DOLLAR;   break;
+            case 'n':  lit = '\n';         break;
+            case 'e':  lit = '\x1b';       break;
+            case '\\': lit = '\\';         break;
+            default:   lit = 0;            break;   // keep "\x" as typed
+            }
+            if (kind != PS_TEXT || lit) p++;
+            else lit = '\\';
+        }
+        p++;
+        if (kind == PS_GIT || kind == PS_KUBE) ps_wants_segments = true;
+
+        // runs of literal text share one segment
+        if (kind == PS_TEXT && ps_nsegs && ps_segs[ps_nsegs - 1].kind == PS_TEXT) {
+            ps_text[tlen++] = lit;
+            ps_segs[ps_nsegs - 1].len++;
+            continue;
+        }
+        if (ps_nsegs == cap) ps_segs = realloc(ps_segs, (cap *= 2) * sizeof(*ps_segs));
+        ps_segs[ps_nsegs++] = (struct ps_seg){ kind, ps_text + tlen, 0 };
+        if (kind == PS_TEXT) {
+            ps_text[tlen++] = lit;
+            ps_segs[ps_nsegs - 1].len = 1;
+        }
+    }
+}
+
+static const char *ps_host(void) {
+    static char host[256];
+
+    if (!host[0] && gethostname(host, sizeof(host) - 1) == 0)
+        host[strcspn(host, ".")] = '\0';
+    return host;
+}
+
+static const char *ps_user(void) {
+    static char user[64];
+
+    if (!user[0]) {
+        struct passwd *pw = getpwuid(geteuid());
+        const char *u = pw ? pw->pw_name : getenv("USER");
+        snprintf(user, sizeof(user), "%s", u ? u : "?");
+    }
+    return user;
+}
+
+static size_t ps_put(size_t at, const char *s, size_t n) {
+    if (n > sizeof(prompt_buf) - 1 - at) n = sizeof(prompt_buf) - 1 - at;
+    memcpy(prompt_buf + at, s, n);
+    return at + n;
+}
+
+static size_t ps_puts(size_t at, const char *s) {
+    return ps_put(at, s, strlen(s));
+}
+
+static struct segments *render_prompt(void) {
+    const char *ps1 = getenv("PS1");
+    struct segments *s = NULL;
+    char tmp[64];
+    size_t at = 0;
+
+    if (continuing) {
+        const char *ps2 = getenv("PS2");
+        prompt_len = ps_puts(0, ps2 ? ps2 : "> ");
+        return NULL;
+    }
+    if (!ps1) ps1 = DEFAULT_PS1;
+    if (!ps_source || strcmp(ps1, ps_source) != 0) ps_compile(ps1);
+
+    if (!getcwd(prompt_cwd, sizeof(prompt_cwd))) prompt_cwd[0] = '\0';
+    if (ps_wants_segments && tasks.efd >= 0 && prompt_cwd[0])
+        s = seg_find(prompt_cwd);
+
+    for (size_t i = 0; i < ps_nsegs; i++) {
+        const struct ps_seg *seg = &ps_segs[i];
+        switch (seg->kind) {
+        case PS_TEXT:
+            at = ps_put(at, seg->text, seg->len);
+            break;
+        case PS_CWD:
+            at = ps_puts(at, prompt_cwd);
+            break;
+        case PS_CWD_BASE: {
+            const char *b = strrchr(prompt_cwd, '/');
+            at = ps_puts(at, b && b[1] ? b + 1 : prompt_cwd);
+            break;
+        }
+        case PS_USER:
+            at = ps_puts(at, ps_user());
+            break;
+        case PS_HOST:
+            at = ps_puts(at, ps_host());
+            break;
+        case PS_STATUS:
+            at = ps_put(at, tmp, (size_t)snprintf(tmp, sizeof(tmp), "%d",
+                                                  last_status));
+            break;
+        case PS_JOBS:
+            at = ps_put(at, tmp, (size_t)snprintf(tmp, sizeof(tmp), "%d",
+                                                  jobs_count()));
+            break;
+        case PS_TIME: {
+            struct tm tm;
+            time_t now = time(NULL);
+            localtime_r(&now, &tm);
+            at = ps_put(at, tmp, strftime(tmp, sizeof(tmp), "%H:%M:%S", &tm));
+            break;
+        }
+        case PS_DURATION: {
+            long ms = (cmd_finished.tv_sec - cmd_started.tv_sec) * 1000 +
+                      (cmd_finished.tv_nsec - cmd_started.tv_nsec) / 1000000;
+            int n = ms < 1000
+                ? snprintf(tmp, sizeof(tmp), "%ldms", ms)
+                : snprintf(tmp, sizeof(tmp), "%ld.%lds", ms / 1000,
+                           ms % 1000 / 100);
+            at = ps_put(at, tmp, (size_t)n);
+            break;
+        }
+        case PS_GIT:
+            if (s && s->git[0]) {
+                at = ps_puts(at, " (");
+                at = ps_puts(at, s->git);
+                at = ps_puts(at, ")");
+            }
+            break;
+        case PS_KUBE:
+            if (s && s->kube[0]) {
+                at = ps_puts(at, " [");
+                at = ps_puts(at, s->kube);
+                at = ps_puts(at, "]");
+            }
+            break;
+        case PS_DOLLAR:
+            at = ps_puts(at, geteuid() == 0 ? "#" : "$");
+            break;
+        }
+    }
+    prompt_len = at;
+    return s;
+}
+
+/* prompt */
+static void print_prompt(void) {
+    struct segments *s = render_prompt();
+
+    fflush(stdout);                 // builtin output goes first
+    write_all(STDOUT_FILENO, prompt_buf, prompt_len);
+    if (s) seg_refresh(s);
+}
+
+/* ---- line editor ----
+ * Raw-mode editing for interactive sessions. The editor remembers what it
+ * last put on the terminal and each refresh emits only the cells that
+ * changed since then, so a keystroke costs one small write() even over a
+ * slow link. Editing is confined to a single terminal row. */
+
+struct line_editor {
+    char   buf[MAX_COMMAND_LINE_LEN];    // line being edited
+    size_t len, pos;
+    char   shown[MAX_COMMAND_LINE_LEN];  // what is on screen after the prompt
+    size_t shown_len, shown_pos;
+    char   kill[MAX_COMMAND_LINE_LEN];   // last killed text, for ctrl-y
+    size_t kill_len;
+    char   saved[MAX_COMMAND_LINE_LEN];  // line being typed before browsing
+    size_t saved_len;
+    size_t hist_pos;                     // history entry shown, or SIZE_MAX
+    unsigned char in[64];                // pending input bytes
+    size_t in_len, in_pos;
+};
+
+static struct line_editor ed;
+static struct termios orig_termios;
+
+static int enable_raw_mode(void) {
+    struct termios raw;
+
+    if (tcgetattr(STDIN_FILENO, &orig_termios) < 0) return -1;
+    raw = orig_termios;
+    // keep OPOST so the rest of the shell can keep writing plain "\n"
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cflag |= CS8;
+    raw.c_cc[VMIN]  = 1;
+    raw.c_cc[VTIME] = 0;
+    return tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+}
+
+static void disable_raw_mode(void) {
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+}
+
+/* append a cursor motion of n cells ('C' right, 'D' left) */
+static size_t ed_move(char *out, size_t at, size_t n, char dir) {
+    if (n == 0) return at;
+    if (n == 1 && dir == 'D') {
+        out[at++] = '\b';
+        return at;
+    }
+    return at + (size_t)sprintf(out + at, "\x1b[%zu%c", n, dir);
+}
+
+/* bring the screen in line with text/cursor, touching only changed cells */
+static void ed_show(const char *text, size_t len, size_t cursor) {
+    // the text, up to three motions and an erase
+    char out[sizeof(ed.shown) + 3 * 24 + 3];
+    size_t at = 0, common = 0;
+
+    if (len > sizeof(ed.shown)) len = sizeof(ed.shown);
+    if (cursor > len) cursor = len;
+
+    while (common < len && common < ed.shown_len &&
+           text[common] == ed.shown[common])
+        common++;
+
+    if (common == len && len == ed.shown_len && cursor == ed.shown_pos)
+        return;
+
+    if (common < len || common < ed.shown_len) {
+        if (ed.shown_pos > common)
+            at = ed_move(out, at, ed.shown_pos - common, 'D');
+        else
+            at = ed_move(out, at, common - ed.shown_pos, 'C');
+        memcpy(out + at, text + common, len - common);
+        at += len - common;
+        if (ed.shown_len > len) {
+            memcpy(out + at, "\x1b[K", 3);
+            at += 3;
+        }
+        at = ed_move(out, at, len - cursor, 'D');
+    } else if (cursor < ed.shown_pos) {
+        at = ed_move(out, at, ed.shown_pos - cursor, 'D');
+    } else {
+        at = ed_move(out, at, cursor - ed.shown_pos, 'C');
+    }
+    write_all(STDOUT_FILENO, out, at);
+
+    memcpy(ed.shown, text, len);
+    ed.shown_len = len;
+    ed.shown_pos = cursor;
+}
+
+static void ed_refresh(void) {
+    ed_show(ed.buf, ed.len, ed.pos);
+}
+
+static void ed_insert(const char *s, size_t n) {
+    if (n > sizeof(ed.buf) - 1 - ed.len) n = sizeof(ed.buf) - 1 - ed.len;
+    memmove(ed.buf + ed.pos + n, ed.buf + ed.pos, ed.len - ed.pos);
+    memcpy(ed.buf + ed.pos, s, n);
+    ed.len += n;
+    ed.pos += n;
+}
+
+/* print candidates in columns below the line, then redraw the prompt */
+static void ed_list_completions(const struct completions *c) {
+    struct winsize ws;
+    size_t width = 0, cols, at = 0;
+    size_t cap = 4096;
+    char *out = malloc(cap);
+
+    for (size_t i = 0; i < c->n; i++)
+        if (strlen(c->v[i]) > width) width = strlen(c->v[i]);
+    width += 2;
+    cols = 80;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        cols = ws.ws_col;
+    cols = cols / width ? cols / width : 1;
+
+    out[at++] = '\n';
+    for (size_t i = 0; i < c->n; i++) {
+        if (at + width + 2 > cap) out = realloc(out, cap *= 2);
+        bool eol = (i + 1) % cols == 0 || i + 1 == c->n;
+        if (eol)
+            at += (size_t)sprintf(out + at, "%s\n", c->v[i]);
+        else
+            at += (size_t)sprintf(out + at, "%-*s", (int)width, c->v[i]);
+    }
+    write_all(STDOUT_FILENO, out, at);
+    free(out);
+    print_prompt();
+    ed.shown_len = ed.shown_pos = 0;
+}
+
+/* extend the word before the cursor (tlen bytes typed) by the candidates'
+ * common prefix; on a repeated tab with nothing to add, list them */
+static void ed_apply_completion(const struct completions *c, size_t tlen,
+                                bool again) {
+    if (c->n == 0) return;
+    size_t lcp = strlen(c->v[0]);
+    for (size_t i = 1; i < c->n; i++) {
+        size_t k = 0;
+        while (k < lcp && c->v[i][k] == c->v[0][k]) k++;
+        lcp = k;
+    }
+    if (lcp > tlen) ed_insert(c->v[0] + tlen, lcp - tlen);
+    if (c->n == 1 && c->v[0][lcp - 1] != '/') ed_insert(" ", 1);
+    else if (c->n > 1 && lcp == tlen && again) ed_list_completions(c);
+}
+
+/* rewrite prompt and line in place, e.g. after new prompt segments */
+static void ed_repaint(void) {
+    char out[sizeof(prompt_buf) + MAX_COMMAND_LINE_LEN + 32];
+    size_t at = 0;
+
+    out[at++] = '\r';
+    memcpy(out + at, prompt_buf, prompt_len);
+    at += prompt_len;
+    memcpy(out + at, ed.shown, ed.shown_len);
+    at += ed.shown_len;
+    memcpy(out + at, "\x1b[K", 3);
+    at += 3;
+    at = ed_move(out, at, ed.shown_len - ed.shown_pos, 'D');
+    write_all(STDOUT_FILENO, out, at);
+}
+
+static void ed_collect_tasks(void) {
+    bool repaint = false, edited = false;
+
+    for (struct task *t = tasks_collect(), *next; t; t = next) {
+        next = t->next;
+        if (t->kind == TASK_PROMPT) {
+            repaint |= seg_store(t);
+        } else if (t->gen == atomic_load(&ed_gen)) {
+            ed_apply_completion(&t->comps, strlen(t->arg), t->again);
+            edited = true;
+        }
+        task_free(t);
+    }
+    if (repaint) {
+        render_prompt();
+        ed_repaint();
+    }
+    if (edited) ed_refresh();
+}
+
+/* next input byte; -1 on EOF/error. Finished background tasks are
+ * applied while waiting for the terminal. */
+static int ed_getc(void) {
+    if (ed.in_pos == ed.in_len) {
+        ssize_t n;
+        while (tasks.efd >= 0) {
+            struct pollfd pfd[2] = {
+                { .fd = STDIN_FILENO, .events = POLLIN },
+                { .fd = tasks.efd,    .events = POLLIN },
+            };
+            if (poll(pfd, 2, -1) < 0 && errno != EINTR) break;
+            if (pfd[1].revents & POLLIN) ed_collect_tasks();
+            if (pfd[0].revents) break;
+        }
+        do {
+            n = read(STDIN_FILENO, ed.in, sizeof(ed.in));
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) return -1;
+        ed.in_len = (size_t)n;
+        ed.in_pos = 0;
+    }
+    return ed.in[ed.in_pos++];
+}
+
+/* remove [from, to) from the line, optionally saving it for ctrl-y */
+static void ed_cut(size_t from, size_t to, bool save) {
+    if (from >= to) return;
+    if (save) {
+        memcpy(ed.kill, ed.buf + from, to - from);
+        ed.kill_len = to - from;
+    }
+    memmove(ed.buf + from, ed.buf + to, ed.len - to);
+    ed.len -= to - from;
+    ed.pos = from;
+}
+
+static size_t ed_word_left(size_t p) {
+    while (p > 0 && ed.buf[p - 1] == ' ') p--;
+    while (p > 0 && ed.buf[p - 1] != ' ') p--;
+    return p;
+}
+
+static size_t ed_word_right(size_t p) {
+    while (p < ed.len && ed.buf[p] == ' ') p++;
+    while (p < ed.len && ed.buf[p] != ' ') p++;
+    return p;
+}
+
+/* decode the rest of an escape sequence into one of the keys below */
+enum { KEY_NONE = 1000, KEY_LEFT, KEY_RIGHT, KEY_UP, KEY_DOWN,
+       KEY_HOME, KEY_END, KEY_DEL, KEY_WORD_LEFT, KEY_WORD_RIGHT };
+
+static int ed_escape(void) {
+    int c = ed_getc();
+    if (c == 'b') return KEY_WORD_LEFT;
+    if (c == 'f') return KEY_WORD_RIGHT;
+    if (c != '[' && c != 'O') return KEY_NONE;
+
+    int k = ed_getc();
+    if (k >= '0' && k <= '9') {
+        int t;
+        while (((t = ed_getc()) >= '0' && t <= '9') || t == ';')
+            ;
+        if (t != '~') return KEY_NONE;
+        switch (k) {
+        case '1': case '7': return KEY_HOME;
+        case '4': case '8': return KEY_END;
+        case '3':           return KEY_DEL;
+        default:            return KEY_NONE;
+        }
+    }
+    switch (k) {
+    case 'A': return KEY_UP;
+    case 'B': return KEY_DOWN;
+    case 'C': return KEY_RIGHT;
+    case 'D': return KEY_LEFT;
+    case 'H': return KEY_HOME;
+    case 'F': return KEY_END;
+    default:  return KEY_NONE;
+    }
+}
+
+/* show the previous (dir < 0) or next distinct history entry */
+static void ed_history_step(int dir) {
+    size_t i, len;
+
+    if (ed.hist_pos == SIZE_MAX) {
+        hist_sync();
+        memcpy(ed.saved, ed.buf, ed.len);
+        ed.saved_len = ed.len;
+        ed.hist_pos = hist.count;
+    }
+    for (i = ed.hist_pos;;) {
+        if (dir < 0) {
+            if (i == 0) return;
+            i--;
+        } else if (++i >= hist.count) {
+            i = hist.count;
+            break;
+        }
+        if (hist_is_latest(i)) break;
+    }
+    ed.hist_pos = i;
+
+    if (i == hist.count) {
+        memcpy(ed.buf, ed.saved, ed.saved_len);
+        ed.len = ed.saved_len;
+    } else {
+        const char *s = hist_entry(i, &len);
+        if (len > sizeof(ed.buf) - 1) len = sizeof(ed.buf) - 1;
+        memcpy(ed.buf, s, len);
+        ed.len = len;
+    }
+    ed.pos = ed.len;
+}
+
+/* ctrl-r: incremental reverse search; returns the key that ended it */
+static int ed_search(void) {
+    char pat[64], view[sizeof(ed.shown)];
+    size_t plen = 0, match = SIZE_MAX, mlen = 0, at = 0;
+    const char *m = "";
+    bool failed = false;
+
+    hist_sync();
+    for (;;) {
+        if (match != SIZE_MAX && match >= hist.count) {
+            match = SIZE_MAX;       // the file shrank under us
+            m = "";
+            mlen = at = 0;
+        }
+        if (match != SIZE_MAX) {
+            m = hist_entry(match, &mlen);
+            const char *hit = plen ? memmem(m, mlen, pat, plen) : NULL;
+            at = hit ? (size_t)(hit - m) : 0;
+        }
+        int n = snprintf(view, sizeof(view), "(%sreverse-i-search)`%.*s': ",
+                         failed ? "failed " : "", (int)plen, pat);
+        // a long match is cut to what fits beside the status
+        size_t shown = mlen;
+        if (shown > sizeof(view) - (size_t)n) shown = sizeof(view) - (size_t)n;
+        memcpy(view + n, m, shown);
+        if (ed.in_pos == ed.in_len)
+            ed_show(view, (size_t)n + shown, (size_t)n + (at < shown ? at : shown));
+
+        int c = ed_getc();
+        if (c < 0 || c == CTRL('g') || c == CTRL('c')) return KEY_NONE;
+        if (c == 0x1b) c = ed_escape();
+
+        size_t from;
+        if (c == CTRL('r')) {
+            if (!plen || match == SIZE_MAX) continue;
+            from = match;
+        } else if (c == 0x7f || c == CTRL('h')) {
+            if (!plen) continue;
+            plen--;
+            from = hist.count;
+        } else if (c >= 0x20 && c < 0x7f && plen < sizeof(pat)) {
+            pat[plen++] = (char)c;
+            from = (match == SIZE_MAX) ? hist.count : match + 1;
+        } else {
+            // anything else accepts the match and is handled as usual
+            if (match != SIZE_MAX) {
+                if (mlen > sizeof(ed.buf) - 1) mlen = sizeof(ed.buf) - 1;
+                memcpy(ed.buf, m, mlen);
+                ed.len = mlen;
+                ed.pos = at < mlen ? at : mlen;
+            }
+            return c;
+        }
+        if (!plen) continue;
+        size_t r = hist_search(pat, plen, from);
+        failed = (r == SIZE_MAX);
+        if (!failed) match = r;
+    }
+}
+
+/* tab: complete the word before the cursor; a second tab lists choices.
+ * File names are read on a worker so a slow directory never blocks typing. */
+static void ed_complete(bool again) {
+    char word[PATH_MAX], dir[PATH_MAX];
+    struct completions c = { 0 };
+    size_t start = ed.pos;
+    bool command = true;
+
+    while (start > 0 && ed.buf[start - 1] != ' ') start--;
+    for (size_t k = 0; k < start; k++)
+        if (ed.buf[k] != ' ') command = false;
+    size_t wlen = ed.pos - start;
+    if (wlen >= sizeof(word)) return;
+    memcpy(word, ed.buf + start, wlen);
+    word[wlen] = '\0';
+
+    char *slash = strrchr(word, '/');
+    if (command && !slash) {
+        complete_command(&c, word);
+        ed_apply_completion(&c, wlen, again);
+        comp_free(&c);
+        return;
+    }
+
+    size_t dlen = slash ? (size_t)(slash - word) + 1 : 0;
+    memcpy(dir, word, dlen);
+    dir[dlen] = '\0';
+    if (tasks.efd >= 0) {
+        struct task *t = calloc(1, sizeof(*t));
+        t->kind = TASK_COMPLETE;
+        t->gen = atomic_load(&ed_gen);
+        t->again = again;
+        memcpy(t->dir, dir, dlen + 1);
+        snprintf(t->arg, sizeof(t->arg), "%s", word + dlen);
+        task_submit(t);
+        return;
+    }
+    complete_file(&c, dir, word + dlen, 0);
+    ed_apply_completion(&c, wlen - dlen, again);
+    comp_free(&c);
+}
+
+/* edit one line on the terminal; -1 on EOF */
+static int edit_line(char *dst, size_t n) {
+    int result = 0, last = 0;
+
+    if (enable_raw_mode() < 0) return -1;
+    ed.len = ed.pos = 0;
+    ed.shown_len = ed.shown_pos = 0;
+    ed.hist_pos = SIZE_MAX;
+
+    for (;;) {
+        int c = ed_getc();
+        if (c < 0) {
+            result = -1;
+            break;
+        }
+        if (c == 0x1b) c = ed_escape();
+        atomic_fetch_add(&ed_gen, 1);
+        if (c == CTRL('r')) c = ed_search();
+
+        if (c == '\r' || c == '\n') break;
+
+        switch (c) {
+        case '\t': ed_complete(last == '\t'); break;
+        case CTRL('a'): case KEY_HOME:  ed.pos = 0;      break;
+        case CTRL('e'): case KEY_END:   ed.pos = ed.len; break;
+        case CTRL('b'): case KEY_LEFT:  if (ed.pos > 0) ed.pos--;      break;
+        case CTRL('f'): case KEY_RIGHT: if (ed.pos < ed.len) ed.pos++; break;
+        case CTRL('p'): case KEY_UP:    ed_history_step(-1); break;
+        case CTRL('n'): case KEY_DOWN:  ed_history_step(1);  break;
+        case KEY_WORD_LEFT:  ed.pos = ed_word_left(ed.pos);  break;
+        case KEY_WORD_RIGHT: ed.pos = ed_word_right(ed.pos); break;
+        case 0x7f: case CTRL('h'):
+            if (ed.pos > 0) ed_cut(ed.pos - 1, ed.pos, false);
+            break;
+        case CTRL('d'):
+            if (ed.len == 0) {
+                result = -1;
+                goto done;
+            }
+            /* fall through */
+        case KEY_DEL:
+            if (ed.pos < ed.len) ed_cut(ed.pos, ed.pos + 1, false);
+            break;
+        case CTRL('k'): ed_cut(ed.pos, ed.len, true);               break;
+        case CTRL('u'): ed_cut(0, ed.pos, true);                    break;
+        case CTRL('w'): ed_cut(ed_word_left(ed.pos), ed.pos, true); break;
+        case CTRL('y'): ed_insert(ed.kill, ed.kill_len);            break;
+        case CTRL('c'):
+            // abandon the line; the caller sees an empty command
+            write_all(STDOUT_FILENO, "^C", 2);
+            ed.len = ed.pos = 0;
+            ed.shown_len = ed.shown_pos = 0;   // leave the text on screen
+            goto done;
+        case CTRL('l'):
+            write_all(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+            print_prompt();
+            ed.shown_len = ed.shown_pos = 0;
+            break;
+        default:
+            if ((c >= 0x20 && c < 0x7f) || (c >= 0x80 && c < 0x100)) {
+                char ch = (char)c;
+                ed_insert(&ch, 1);
+            }
+            break;
+        }
+        // batch a burst of input (paste, key repeat) into one redraw
+        if (ed.in_pos == ed.in_len) ed_refresh();
+        last = c;
+    }
+done:
+    ed_refresh();
+    write_all(STDOUT_FILENO, "\n", 1);
+    disable_raw_mode();
+
+    if (ed.len >= n) ed.len = n - 1;
+    memcpy(dst, ed.buf, ed.len);
+    dst[ed.len] = '\0';
+    return result;
+}
+
+/* ---- input ----
+ * Command lines read from a script or pipe, and the read builtin, take
+ * stdin through one block buffer instead of a read() per byte. Before a
+ * child starts, unread bytes are handed back with lseek() when stdin is
+ * seekable, so the child carries on where the shell stopped; read-ahead
+ * from a pipe cannot be given back. */
+
+struct inbuf {
+    char   buf[4096];
+    size_t pos, len;
+};
+
+static struct inbuf in;
+
+static bool in_fill(struct inbuf *ib) {
+    ssize_t r;
+
+    if (io->ring_in)
+        r = (ssize_t)ring_read(io->ring_in, ib->buf, sizeof(ib->buf));
+    else
+        do r = read(io->in, ib->buf, sizeof(ib->buf));
+        while (r < 0 && errno == EINTR);
+    ib->pos = 0;
+    ib->len = r > 0 ? (size_t)r : 0;
+    return r > 0;
+}
+
+/* append one line of the current builtin's input, without its newline,
+ * to b; 0 if the line ended with a newline, 1 if it ended at EOF, -1 at
+ * EOF with nothing read */
+static int in_line(struct strbuf *b) {
+    struct inbuf *ib = io->inb ? io->inb : &in;
+    bool any = false;
+
+    sb_put(b, "", 0);
+    for (;;) {
+        if (ib->pos == ib->len && !in_fill(ib)) return any ? 1 : -1;
+        char *start = ib->buf + ib->pos;
+        char *nl = memchr(start, '\n', ib->len - ib->pos);
+        size_t n = nl ? (size_t)(nl - start) : ib->len - ib->pos;
+        sb_put(b, start, n);
+        ib->pos += n + (nl != NULL);
+        any = true;
+        if (nl) return 0;
+    }
+}
+
+/* give unread input back to the file before a child reads it */
+static void in_release(void) {
+    if (in.pos < in.len &&
+        lseek(STDIN_FILENO, -(off_t)(in.len - in.pos), SEEK_CUR) >= 0)
+        in.pos = in.len = 0;
+}
+
+/* read one command line without its newline; -1 on EOF */
+static int read_line(char *dst, size_t n) {
+    static struct strbuf line;
+
+    if (isatty(STDIN_FILENO)) return edit_line(dst, n);
+
+    line.len = 0;
+    if (in_line(&line) < 0) return -1;
+    if (line.len >= n) line.len = n - 1;
+    memcpy(dst, line.p, line.len);
+    dst[line.len] = '\0';
+    return 0;
+}
+
+/* ---- arena ----
+ * Bump allocator for everything belonging to one command line: tokens,
+ * parse nodes and expanded words. It is reset before the next line. */
+
+#define ARENA_CHUNK (64 * 1024)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used, cap;
+    char   data[];
+};
+
+static struct arena_chunk *arena;
+
+static void *arena_alloc(size_t n) {
+    n = (n + 15) & ~(size_t)15;
+    if (!arena || arena->cap - arena->used < n) {
+        size_t cap = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+        struct arena_chunk *c = malloc(sizeof(*c) + cap);
+        if (!c) {
+            perror("malloc");
+            exit(1);
+        }
+        c->next = arena;
+        c->used = 0;
+        c->cap = cap;
+        arena = c;
+    }
+    void *p = arena->data + arena->used;
+    arena->used += n;
+    return p;
+}
+
+static char *arena_strndup(const char *s, size_t n) {
+    char *p = arena_alloc(n + 1);
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+/* release everything but the oldest chunk */
+static void arena_reset(void) {
+    while (arena && arena->next) {
+        struct arena_chunk *next = arena->next;
+        free(arena);
+        arena = next;
+    }
+    if (arena) arena->used = 0;
+}
+
+struct arena_mark {
+    struct arena_chunk *chunk;
+    size_t              used;
+};
+
+static struct arena_mark arena_save(void) {
+    return (struct arena_mark){ arena, arena ? arena->used : 0 };
+}
+
+/* free everything allocated since m */
+static void arena_restore(struct arena_mark m) {
+    while (arena != m.chunk) {
+        struct arena_chunk *next = arena->next;
+        free(arena);
+        arena = next;
+    }
+    if (arena) arena->used = m.used;
+}
+
+/* Heap blocks replaced while the current line may still point into them
+ * (alias token lists, function bodies) are freed before the next line. */
+static void  **retired;
+static size_t  nretired;
+
+static void retire(void *p) {
+    retired = realloc(retired, (nretired + 1) * sizeof(*retired));
+    retired[nretired++] = p;
+}
+
+static void retired_reap(void) {
+    while (nretired) free(retired[--nretired]);
+}
+
+/* ---- lexer ----
+ * Splits a line into words and operators. Words keep their quotes and
+ * $-references as typed; quote removal and expansion happen only when a
+ * command runs, so token lists can be stored (aliases) and reused
+ * without lexing again. A newline separates commands like ';'. */
+
+enum tok_kind {
+    T_WORD, T_SEMI, T_AMP, T_LPAREN, T_RPAREN, T_AND, T_OR, T_PIPE,
+    T_GT, T_APPEND, T_LT, T_DUP,    // redirections: > >> < >&
+    T_IONUM                         // the fd in "2>", a word of digits
+};
+
+struct token {
+    enum tok_kind kind;
+    const char   *text;             // raw word, or the operator
+};
+
+static const char operators[] = ";&|<>()\n";
+
+/* tokens of line, allocated in the arena */
+static int lex(const char *line, struct token **out) {
+    struct token *v = arena_alloc((strlen(line) + 1) * sizeof(*v));
+    const char *p = line;
+    int n = 0;
+
+    for (;;) {
+        p += strspn(p, delimiters);
+        if (!*p) break;
+        if (*p == '#') {
+            p += strcspn(p, "\n");
+            continue;
+        }
+
+        if ((p[0] == '&' || p[0] == '|') && p[1] == p[0]) {
+            v[n++] = *p == '&' ? (struct token){ T_AND, "&&" }
+                               : (struct token){ T_OR, "||" };
+            p += 2;
+            continue;
+        }
+        switch (*p) {
+        case '\n': v[n++] = (struct token){ T_SEMI, "\n" }; p++; continue;
+        case ';': v[n++] = (struct token){ T_SEMI, ";" };   p++; continue;
+        case '&': v[n++] = (struct token){ T_AMP, "&" };    p++; continue;
+        case '|': v[n++] = (struct token){ T_PIPE, "|" };   p++; continue;
+        case '<': v[n++] = (struct token){ T_LT, "<" };     p++; continue;
+        case '>':
+            if (p[1] == '>') v[n++] = (struct token){ T_APPEND, ">>" };
+            else if (p[1] == '&') v[n++] = (struct token){ T_DUP, ">&" };
+            else v[n++] = (struct token){ T_GT, ">" };
+            p += 1 + (p[1] == '>' || p[1] == '&');
+            continue;
+        case '(': v[n++] = (struct token){ T_LPAREN, "(" }; p++; continue;
+        case ')': v[n++] = (struct token){ T_RPAREN, ")" }; p++; continue;
+        }
+
+        const char *start = p;
+        while (*p && !strchr(delimiters, *p) && !strchr(operators, *p)) {
+            char q = *p++;
+            if (q == '\'' || q == '"') {
+                while (*p && *p != q) {
+                    if (q == '"' && *p == '\\' && p[1]) p++;
+                    p++;
+                }
+                if (*p) p++;
+            } else if (q == '\\' && *p) {
+                p++;
+            }
+        }
+        size_t len = (size_t)(p - start);
+        bool ionum = (*p == '<' || *p == '>') && strspn(start, "0123456789") == len;
+        v[n++] = (struct token){ ionum ? T_IONUM : T_WORD, arena_strndup(start, len) };
+    }
+    *out = v;
+    return n;
+}
+
+/* one heap block holding a copy of the tokens and their text */
+static struct token *tokens_dup(const struct token *v, int n) {
+    size_t size = (size_t)n * sizeof(*v);
+    for (int i = 0; i < n; i++) size += strlen(v[i].text) + 1;
+
+    struct token *copy = malloc(size ? size : 1);
+    char *text = (char *)(copy + n);
+    for (int i = 0; i < n; i++) {
+        size_t len = strlen(v[i].text) + 1;
+        memcpy(text, v[i].text, len);
+        copy[i] = (struct token){ v[i].kind, text };
+        text += len;
+    }
+    return copy;
+}
+
+static bool tok_is(const struct token *t, const char *word) {
+    return t->kind == T_WORD && strcmp(t->text, word) == 0;
+}
+
+static bool tok_starts_command(const struct token *v, int i) {
+    return i == 0 || v[i - 1].kind == T_SEMI || v[i - 1].kind == T_AMP ||
+           v[i - 1].kind == T_AND || v[i - 1].kind == T_OR ||
+           v[i - 1].kind == T_PIPE || tok_is(&v[i - 1], "{");
+}
+
+/* ---- aliases ----
+ * Values are lexed once, when defined. The first use of an alias after
+ * any alias change resolves nested aliases in its value and memoizes the
+ * flattened list; applying it then just splices those tokens into the
+ * line. Inside a cycle an alias's expansion depends on which aliases are
+ * already being expanded, so the memo is keyed on that set too. Replaced
+ * lists may still be referenced by the line being run, so they are
+ * retired and freed before the next line. */
+
+#define ALIAS_BUCKETS 128
+
+struct alias {
+    struct alias *next;             // hash chain
+    char         *name, *value;
+    struct token *toks;             // value, lexed
+    int           ntoks;
+    struct token *resolved;         // toks with nested aliases expanded
+    int           nresolved;
+    unsigned      resolved_gen;
+    uint64_t      resolved_cut;     // alias_cut it was resolved under
+    bool          resolving;        // on the chain being expanded
+};
+
+static struct alias *aliases[ALIAS_BUCKETS];
+static unsigned      alias_gen = 1; // bumped by every alias change
+static uint64_t      alias_cut;     // the resolving set, as xored marks
+
+static uint64_t alias_mark(const struct alias *a) {
+    uint64_t x = (uint64_t)(uintptr_t)a * 0x9e3779b97f4a7c15ULL;
+    return x ^ (x >> 29);
+}
+
+static struct alias **alias_slot(const char *name) {
+    struct alias **a = &aliases[hash_bytes(name, strlen(name)) % ALIAS_BUCKETS];
+    while (*a && strcmp((*a)->name, name) != 0) a = &(*a)->next;
+    return a;
+}
+
+static void alias_set(const char *name, const char *value) {
+    struct alias **slot = alias_slot(name), *a = *slot;
+    struct token *v;
+
+    if (a) {
+        free(a->value);
+        retire(a->toks);
+        retire(a->resolved);
+    } else {
+        a = *slot = calloc(1, sizeof(*a));
+        a->name = strdup(name);
+    }
+    a->value = strdup(value);
+    a->ntoks = lex(value, &v);
+    a->toks = tokens_dup(v, a->ntoks);
+    a->resolved = NULL;
+    alias_gen++;
+}
+
+static bool alias_unset(const char *name) {
+    struct alias **slot = alias_slot(name), *a = *slot;
+
+    if (!a) return false;
+    *slot = a->next;
+    retire(a->toks);
+    retire(a->resolved);
+    free(a->name);
+    free(a->value);
+    free(a);
+    alias_gen++;
+    return true;
+}
+
+static int alias_splice(const struct token *v, int n, struct token **out);
+
+/* the alias to expand at v[i], with its flattened list up to date */
+static struct alias *alias_at(const struct token *v, int i) {
+    if (v[i].kind != T_WORD || !tok_starts_command(v, i)) return NULL;
+    if (strpbrk(v[i].text, "'\"\\$")) return NULL;    // quoted: no alias
+
+    struct alias *a = *alias_slot(v[i].text);
+    if (!a || a->resolving) return NULL;
+    if (a->resolved_gen != alias_gen || a->resolved_cut != alias_cut) {
+        struct token *r;
+        uint64_t cut = alias_cut;
+        a->resolving = true;
+        alias_cut ^= alias_mark(a);
+        a->nresolved = alias_splice(a->toks, a->ntoks, &r);
+        alias_cut = cut;
+        a->resolving = false;
+        retire(a->resolved);
+        a->resolved = tokens_dup(r, a->nresolved);
+        a->resolved_gen = alias_gen;
+        a->resolved_cut = cut;
+    }
+    return a;
+}
+
+/* v with aliases replaced at command positions, built in the arena */
+static int alias_splice(const struct token *v, int n, struct token **out) {
+    int total = 0;
+
+    for (int i = 0; i < n; i++) {
+        struct alias *a = alias_at(v, i);
+        total += a ? a->nresolved : 1;
+    }
+    struct token *r = arena_alloc(((size_t)total + 1) * sizeof(*r));
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        struct alias *a = alias_at(v, i);
+        if (!a) {
+            r[k++] = v[i];
+            continue;
+        }
+        memcpy(r + k, a->resolved, (size_t)a->nresolved * sizeof(*r));
+        k += a->nresolved;
+    }
+    *out = r;
+    return k;
+}
+
+/* ---- parser ---- */
+
+enum run_if { RUN_ALWAYS, RUN_IF_OK, RUN_IF_FAILED };   // ';', '&&', '||'
+
+struct redir {
+    int            fd;              // the fd being redirected
+    enum tok_kind  kind;            // T_GT, T_APPEND, T_LT or T_DUP
+    const char    *target;          // raw word: a file, or an fd for T_DUP
+};
+
+struct command {
+    char          **words;          // raw words, NULL-terminated
+    int             nwords;
+    struct redir   *redirs;         // in the order written
+    int             nredirs;
+    bool            background;
+    bool            pipe_next;      // output feeds the next command
+    enum run_if     run_if;         // on the status of what ran before
+    const char     *func_name;      // set for "name() { body }"
+    struct command *body;
+    int             nbody;
+};
+
+#define PARSE_INCOMPLETE (-2)       // a function body is still open
+
+static int syntax_error(const struct token *t) {
+    fprintf(stderr, "syntax error near '%s'\n",
+            !t ? "end of line" : *t->text == '\n' ? "newline" : t->text);
+    return -1;
+}
+
+static bool valid_func_name(const char *s) {
+    if (!*s || (*s >= '0' && *s <= '9')) return false;
+    for (; *s; s++)
+        if (!(*s == '_' || *s == '-' || *s == '.' || (*s >= 'a' && *s <= 'z') ||
+              (*s >= 'A' && *s <= 'Z') || (*s >= '0' && *s <= '9')))
+            return false;
+    return true;
+}
+
+static bool tok_is_redir(const struct token *t) {
+    return t->kind == T_GT || t->kind == T_APPEND || t->kind == T_LT ||
+           t->kind == T_DUP;
+}
+
+static bool tok_is_newline(const struct token *t) {
+    return t->kind == T_SEMI && *t->text == '\n';
+}
+
+static bool tok_ends_command(const struct token *t) {
+    return t->kind == T_SEMI || t->kind == T_AMP || t->kind == T_AND ||
+           t->kind == T_OR || t->kind == T_PIPE;
+}
+
+/* commands from v[*i] to the end, or to the '}' closing a body; -1 on a
+ * syntax error, PARSE_INCOMPLETE if more input could complete it */
+static int parse_list(const struct token *v, int n, int *i, bool in_body,
+                      struct command **out) {
+    struct command *cmds = arena_alloc(((size_t)(n - *i) + 1) * sizeof(*cmds));
+    enum run_if run_if = RUN_ALWAYS;
+    int nc = 0;
+
+    while (*i < n) {
+        struct command *c = &cmds[nc];
+        memset(c, 0, sizeof(*c));
+        c->run_if = run_if;
+        run_if = RUN_ALWAYS;
+
+        if (in_body && tok_is(&v[*i], "}") && tok_starts_command(v, *i)) {
+            ++*i;
+            *out = cmds;
+            return nc;
+        }
+
+        if (v[*i].kind == T_WORD && *i + 2 < n && v[*i + 1].kind == T_LPAREN &&
+            v[*i + 2].kind == T_RPAREN && tok_starts_command(v, *i)) {
+            if (!valid_func_name(v[*i].text)) return syntax_error(&v[*i + 1]);
+            c->func_name = v[*i].text;
+            *i += 3;
+            while (*i < n && v[*i].kind == T_SEMI) ++*i;
+            if (*i == n) return PARSE_INCOMPLETE;
+            if (!tok_is(&v[*i], "{")) return syntax_error(&v[*i]);
+            ++*i;
+            c->nbody = parse_list(v, n, i, true, &c->body);
+            if (c->nbody < 0) return c->nbody;
+            if (*i < n && v[*i].kind != T_SEMI) return syntax_error(&v[*i]);
+            if (*i < n) ++*i;
+            nc++;
+            continue;
+        }
+
+        c->words = arena_alloc(((size_t)(n - *i) + 1) * sizeof(*c->words));
+        c->redirs = arena_alloc(((size_t)(n - *i) + 1) * sizeof(*c->redirs));
+        for (; *i < n && !tok_ends_command(&v[*i]); ++*i) {
+            int fd = -1;
+            if (v[*i].kind == T_IONUM) {
+                fd = atoi(v[(*i)++].text);
+                if (*i == n || !tok_is_redir(&v[*i])) return syntax_error(&v[*i - 1]);
+            }
+            if (tok_is_redir(&v[*i])) {
+                if (*i + 1 >= n || v[*i + 1].kind != T_WORD) {
+                    fprintf(stderr, "usage: command ... %s filename\n", v[*i].text);
+                    return -1;
+                }
+                if (fd < 0) fd = v[*i].kind == T_LT ? 0 : 1;
+                c->redirs[c->nredirs++] =
+                    (struct redir){ fd, v[*i].kind, v[*i + 1].text };
+                ++*i;
+                continue;
+            }
+            if (v[*i].kind != T_WORD) return syntax_error(&v[*i]);
+            c->words[c->nwords++] = (char *)v[*i].text;
+        }
+        c->words[c->nwords] = NULL;
+        bool more = false;
+        if (*i < n && (v[*i].kind == T_AND || v[*i].kind == T_OR ||
+                       v[*i].kind == T_PIPE)) {
+            if (!c->nwords && !c->nredirs) return syntax_error(&v[*i]);
+            if (v[*i].kind != T_PIPE)
+                run_if = v[*i].kind == T_AND ? RUN_IF_OK : RUN_IF_FAILED;
+            c->pipe_next = v[*i].kind == T_PIPE;
+            more = true;
+        }
+        if (*i < n) c->background = v[(*i)++].kind == T_AMP;
+        if (c->nwords || c->nredirs) nc++;
+        // '&&', '||' and '|' may end a line; the list goes on in the next
+        if (more) {
+            while (*i < n && tok_is_newline(&v[*i])) ++*i;
+            if (*i == n) return PARSE_INCOMPLETE;
+        }
+    }
+    if (in_body) return PARSE_INCOMPLETE;
+    *out = cmds;
+    return nc;
+}
+
+/* split tokens into commands at ';', '&' and newlines */
+static int parse(const struct token *v, int n, struct command **out) {
+    int i = 0;
+    return parse_list(v, n, &i, false, out);
+}
+
+/* ---- functions ----
+ * A definition keeps its body as parsed commands, copied out of the arena
+ * into one heap block, so a call runs them without lexing or parsing
+ * again. Arguments go on a fixed frame stack that $1.., $#, $@ and $*
+ * read; the words a call expands are released when it returns. */
+
+#define FUNC_BUCKETS 64
+#define MAX_FRAMES   128
+
+struct function {
+    struct function *next;          // hash chain
+    char            *name;
+    struct command  *body;          // one block, freed as a whole
+    int              nbody;
+};
+
+struct frame {
+    int    argc;
+    char **argv;                    // argv[0] is the function name
+};
+
+static struct function *functions[FUNC_BUCKETS];
+static struct frame     frames[MAX_FRAMES];
+static int              nframes;
+static bool             returning;  // `return` ran; unwind the body
+
+static size_t commands_size(const struct command *c, int n, size_t *text) {
+    size_t size = (size_t)n * sizeof(*c);
+
+    for (int i = 0; i < n; i++) {
+        size += ((size_t)c[i].nwords + 1) * sizeof(char *);
+        size += (size_t)c[i].nredirs * sizeof(struct redir);
+        for (int w = 0; w < c[i].nwords; w++) *text += strlen(c[i].words[w]) + 1;
+        for (int k = 0; k < c[i].nredirs; k++) *text += strlen(c[i].redirs[k].target) + 1;
+        if (c[i].func_name) *text += strlen(c[i].func_name) + 1;
+        size += commands_size(c[i].body, c[i].nbody, text);
+    }
+    return size;
+}
+
+static char *copy_text(char **text, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *r = memcpy(*text, s, len);
+    *text += len;
+    return r;
+}
+
+static struct command *commands_copy(const struct command *c, int n,
+                                     char **obj, char **text) {
+    struct command *r = (struct command *)*obj;
+
+    *obj += (size_t)n * sizeof(*c);
+    for (int i = 0; i < n; i++) {
+        r[i] = c[i];
+        r[i].words = (char **)*obj;
+        *obj += ((size_t)c[i].nwords + 1) * sizeof(char *);
+        for (int w = 0; w < c[i].nwords; w++)
+            r[i].words[w] = copy_text(text, c[i].words[w]);
+        r[i].words[c[i].nwords] = NULL;
+        r[i].redirs = (struct redir *)*obj;
+        *obj += (size_t)c[i].nredirs * sizeof(struct redir);
+        for (int k = 0; k < c[i].nredirs; k++) {
+            r[i].redirs[k] = c[i].redirs[k];
+            r[i].redirs[k].target = copy_text(text, c[i].redirs[k].target);
+        }
+        if (c[i].func_name) r[i].func_name = copy_text(text, c[i].func_name);
+        r[i].body = commands_copy(c[i].body, c[i].nbody, obj, text);
+    }
+    return r;
+}
+
+/* one heap block holding a deep copy of n commands */
+static struct command *commands_dup(const struct command *c, int n) {
+    size_t text = 0, size = commands_size(c, n, &text);
+    char *obj = malloc(size + text + 1), *t = obj + size;
+
+    if (!obj) {
+        perror("malloc");
+        exit(1);
+    }
+    return commands_copy(c, n, &obj, &t);
+}
+
+static struct function **function_slot(const char *name) {
+    struct function **f = &functions[hash_bytes(name, strlen(name)) % FUNC_BUCKETS];
+    while (*f && strcmp((*f)->name, name) != 0) f = &(*f)->next;
+    return f;
+}
+
+static struct function *function_find(const char *name) {
+    return *function_slot(name);
+}
+
+static void function_define(const struct command *def) {
+    struct function **slot = function_slot(def->func_name), *f = *slot;
+
+    if (f) {
+        retire(f->body);            // may be running right now
+    } else {
+        f = *slot = calloc(1, sizeof(*f));
+        f->name = strdup(def->func_name);
+    }
+    f->body = commands_dup(def->body, def->nbody);
+    f->nbody = def->nbody;
+}
+
+static int run_pipeline(const struct command *c);
+
+static void function_call(const struct function *f, int argc, char **argv) {
+    const struct command *body = f->body;
+    int nbody = f->nbody;
+
+    if (nframes == MAX_FRAMES) {
+        fprintf(stderr, "%s: maximum function nesting exceeded\n", argv[0]);
+        last_status = 1;
+        return;
+    }
+    frames[nframes++] = (struct frame){ argc, argv };
+    last_status = 0;
+
+    struct arena_mark m = arena_save();
+    for (int i = 0; i < nbody && !returning; ) {
+        i += run_pipeline(&body[i]);
+        arena_restore(m);
+    }
+    nframes--;
+    returning = false;
+}
+
+/* positional parameter k of the innermost call, or NULL */
+static const char *positional(long k) {
+    if (!nframes || k < 0) return NULL;
+    const struct frame *f = &frames[nframes - 1];
+    return k < f->argc ? f->argv[k] : NULL;
+}
+
+static int positional_count(void) {
+    return nframes ? frames[nframes - 1].argc - 1 : 0;
+}
+
+/* ---- rc recording ----
+ * While ~/.shellrc runs for the first time we note what its result
+ * depends on: the files it sourced, the variables it read from the
+ * inherited environment, and whether it did anything beyond defining
+ * state (running programs, printing, cd, failing) that a snapshot cannot
+ * replay. */
+
+#define RC_MAX_DEPS 32
+
+struct rc_dep {
+    char     *path;                 // as sourced, made absolute
+    char     *real;                 // what it resolved to
+    int64_t   mtime_sec, mtime_nsec;
+    uint64_t  size;
+    uint32_t  hash;
+};
+
+struct rc_var {
+    char *name;
+    char *value;                    // as first read; NULL if unset then
+    bool  read, set;
+};
+
+static struct {
+    bool           active, impure;
+    struct rc_dep  deps[RC_MAX_DEPS];
+    int            ndeps;
+    struct rc_var *vars;
+    int            nvars, cap;
+} rc;
+
+static struct rc_var *rc_var(const char *name) {
+    for (int i = 0; i < rc.nvars; i++)
+        if (strcmp(rc.vars[i].name, name) == 0) return &rc.vars[i];
+    if (rc.nvars == rc.cap) {
+        rc.cap = rc.cap ? rc.cap * 2 : 32;
+        rc.vars = realloc(rc.vars, (size_t)rc.cap * sizeof(*rc.vars));
+    }
+    rc.vars[rc.nvars] = (struct rc_var){ strdup(name), NULL, false, false };
+    return &rc.vars[rc.nvars++];
+}
+
+static void rc_note_read(const char *name, const char *value) {
+    struct rc_var *v = rc_var(name);
+    if (v->read || v->set) return;  // only inherited values matter
+    v->read = true;
+    v->value = value ? strdup(value) : NULL;
+}
+
+static void rc_note_dep(const char *path, const char *real, const struct stat *st,
+                        uint32_t hash) {
+    if (rc.ndeps == RC_MAX_DEPS) {
+        rc.impure = true;
+        return;
+    }
+    struct rc_dep *d = &rc.deps[rc.ndeps++];
+    d->path = strdup(path);
+    d->real = strdup(real);
+    d->mtime_sec = st->st_mtim.tv_sec;
+    d->mtime_nsec = st->st_mtim.tv_nsec;
+    d->size = (uint64_t)st->st_size;
+    d->hash = hash;
+}
+
+/* commands a snapshot can stand in for */
+static void rc_note_command(int argc, char **argv) {
+    if (strcmp(argv[0], "setenv") == 0 || strcmp(argv[0], "unalias") == 0 ||
+        strcmp(argv[0], "source") == 0 || strcmp(argv[0], ".") == 0 ||
+        strcmp(argv[0], "return") == 0)
+        return;
+    if (strcmp(argv[0], "alias") == 0) {
+        int i = 1;
+        while (i < argc && strchr(argv[i], '=')) i++;
+        if (argc > 1 && i == argc) return;  // defines only, prints nothing
+    }
+    rc.impure = true;
+}
+
+static void rc_log_free(void) {
+    for (int i = 0; i < rc.ndeps; i++) {
+        free(rc.deps[i].path);
+        free(rc.deps[i].real);
+    }
+    for (int i = 0; i < rc.nvars; i++) {
+        free(rc.vars[i].name);
+        free(rc.vars[i].value);
+    }
+    free(rc.vars);
+    memset(&rc, 0, sizeof(rc));
+}
+
+/* an environment variable, as expansion sees it */
+static const char *var_get(const char *name) {
+    const char *v = getenv(name);
+    if (rc.active) rc_note_read(name, v);
+    return v;
+}
+
+/* ---- expansion ----
+ * Quote removal plus $NAME, ${NAME}, $?, $$, positional parameters and a
+ * leading ~. A word made only of unquoted expansions that come out empty
+ * disappears; a word that is just $@ or "$@" becomes one per argument. */
+
+/* expand the $-reference at *pp (just past the '$'), advancing *pp */
+static void expand_var(struct strbuf *b, const char **pp) {
+    const char *p = *pp;
+    char name[256], num[16];
+    size_t n = 0;
+
+    if (*p == '?' || *p == '$' || *p == '#') {
+        if (*p == '$' && rc.active) rc.impure = true;
+        int v = *p == '?' ? last_status
+              : *p == '$' ? (int)getpid() : positional_count();
+        sb_put(b, num, (size_t)snprintf(num, sizeof(num), "%d", v));
+        *pp = p + 1;
+        return;
+    }
+    if (*p == '@' || *p == '*') {
+        for (int i = 1; i <= positional_count(); i++) {
+            if (i > 1) sb_put(b, " ", 1);
+            sb_put(b, positional(i), strlen(positional(i)));
+        }
+        *pp = p + 1;
+        return;
+    }
+    if (*p >= '0' && *p <= '9') {
+        const char *val = positional(*p - '0');
+        if (val) sb_put(b, val, strlen(val));
+        *pp = p + 1;
+        return;
+    }
+    if (*p == '{') {
+        const char *end = strchr(p, '}');
+        if (!end) {
+            sb_put(b, "$", 1);
+            return;
+        }
+        n = (size_t)(end - p - 1);
+        if (n >= sizeof(name)) n = sizeof(name) - 1;
+        memcpy(name, p + 1, n);
+        p = end + 1;
+    } else {
+        while ((*p == '_' || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+                (n && *p >= '0' && *p <= '9')) && n < sizeof(name) - 1)
+            name[n++] = *p++;
+        if (!n) {
+            sb_put(b, "$", 1);      // a lone '$' stays literal
+            return;
+        }
+    }
+    name[n] = '\0';
+    const char *val = n && strspn(name, "0123456789") == n
+        ? positional(strtol(name, NULL, 10)) : var_get(name);
+    if (val) sb_put(b, val, strlen(val));
+    *pp = p;
+}
+
+/* expanded word in the arena, or NULL if it expanded to nothing */
+static char *expand_word(const char *raw) {
+    static struct strbuf b;
+    const char *p = raw;
+    bool quoted = false;
+
+    b.len = 0;
+    sb_put(&b, "", 0);
+    if (p[0] == '~' && (p[1] == '/' || !p[1]) && var_get("HOME")) {
+        sb_put(&b, getenv("HOME"), strlen(getenv("HOME")));
+        p++;
+    }
+    while (*p) {
+        char c = *p++;
+        if (c == '\'') {
+            quoted = true;
+            const char *end = strchr(p, '\'');
+            size_t n = end ? (size_t)(end - p) : strlen(p);
+            sb_put(&b, p, n);
+            p += n + (end != NULL);
+        } else if (c == '"') {
+            quoted = true;
+            while (*p && *p != '"') {
+                if (*p == '\\' && p[1] && strchr("\"\\$", p[1])) {
+                    sb_put(&b, p + 1, 1);
+                    p += 2;
+                } else if (*p == '$') {
+                    p++;
+                    expand_var(&b, &p);
+                } else {
+                    sb_put(&b, p++, 1);
+                }
+            }
+            if (*p) p++;
+        } else if (c == '\\' && *p) {
+            quoted = true;
+            sb_put(&b, p++, 1);
+        } else if (c == '$') {
+            expand_var(&b, &p);
+        } else {
+            sb_put(&b, &c, 1);
+        }
+    }
+    if (b.len == 0 && !quoted && strchr(raw, '$')) return NULL;
+    return arena_strndup(b.p, b.len);
+}
+
+static bool is_all_args(const char *raw) {
+    return strcmp(raw, "$@") == 0 || strcmp(raw, "\"$@\"") == 0;
+}
+
+/* argv for a command, in the arena */
+static char **expand_command(const struct command *c, int *argc) {
+    size_t cap = (size_t)c->nwords + 1;
+    int n = 0;
+
+    for (int i = 0; i < c->nwords; i++)
+        if (is_all_args(c->words[i])) cap += (size_t)positional_count();
+
+    char **argv = arena_alloc(cap * sizeof(*argv));
+    for (int i = 0; i < c->nwords; i++) {
+        if (is_all_args(c->words[i])) {
+            for (int k = 1; k <= positional_count(); k++)
+                argv[n++] = (char *)positional(k);
+            continue;
+        }
+        char *w = expand_word(c->words[i]);
+        if (w) argv[n++] = w;
+    }
+    argv[n] = NULL;
+    *argc = n;
+    return argv;
+}
+
+/* ---- redirection ----
+ * A child installs its redirections after fork. Builtins and functions
+ * run in the shell, so theirs are opened by the shell and installed
+ * around the call, with each replaced fd saved first and put back
+ * afterwards; they never need a fork to honor a redirection. */
+
+#define MAX_SAVED_FDS 16
+
+struct saved_fds {
+    int           n;
+    int           fd[MAX_SAVED_FDS];
+    int           copy[MAX_SAVED_FDS];  // -1: fd was not open
+    struct inbuf *in;                   // stdin read-ahead, if fd 0 moved
+};
+
+static void redirs_restore(struct saved_fds *saved) {
+    while (saved->n > 0) {
+        saved->n--;
+        int fd = saved->fd[saved->n], copy = saved->copy[saved->n];
+        if (copy >= 0) {
+            dup2(copy, fd);
+            close(copy);
+        } else {
+            close(fd);
+        }
+    }
+    if (saved->in) {
+        in = *saved->in;
+        free(saved->in);
+        saved->in = NULL;
+    }
+}
+
+static bool redir_save(struct saved_fds *saved, int fd) {
+    for (int i = 0; i < saved->n; i++)
+        if (saved->fd[i] == fd) return true;
+    if (saved->n == MAX_SAVED_FDS) {
+        fprintf(stderr, "too many redirections\n");
+        return false;
+    }
+    saved->fd[saved->n] = fd;
+    saved->copy[saved->n++] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    if (fd == STDIN_FILENO) {
+        // what was read ahead belongs to the old stdin
+        saved->in = malloc(sizeof(*saved->in));
+        *saved->in = in;
+        in.pos = in.len = 0;
+    }
+    return true;
+}
+
+/* install c's redirections; with saved, remember what they replace so
+ * redirs_restore() can undo them. -1 after a message on failure, with
+ * nothing left installed when saved is given. */
+static int redirs_apply(const struct command *c, struct saved_fds *saved) {
+    for (int i = 0; i < c->nredirs; i++) {
+        const struct redir *r = &c->redirs[i];
+        char *target = expand_word(r->target);
+        int fd;
+
+        if (!target) {
+            fprintf(stderr, "%s: ambiguous redirect\n", r->target);
+            goto fail;
+        }
+        if (saved && !redir_save(saved, r->fd)) goto fail;
+
+        if (r->kind == T_DUP) {
+            char *end;
+            long from = strtol(target, &end, 10);
+            if (strcmp(target, "-") == 0) {
+                close(r->fd);
+            } else if (end == target || *end || from < 0 || from > INT_MAX ||
+                       dup2((int)from, r->fd) < 0) {
+                fprintf(stderr, "%s: bad file descriptor\n", target);
+                goto fail;
+            }
+            continue;
+        }
+        fd = r->kind == T_LT ? open(target, O_RDONLY | O_CLOEXEC)
+           : r->kind == T_APPEND
+               ? open(target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666)
+               : open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s\n", target, strerror(errno));
+            goto fail;
+        }
+        if (fd == r->fd) {
+            fcntl(fd, F_SETFD, 0);          // keep it across exec
+        } else {
+            dup2(fd, r->fd);
+            close(fd);
+        }
+    }
+    return 0;
+fail:
+    if (saved) redirs_restore(saved);
+    return -1;
+}
+
+static volatile sig_atomic_t fg_child = -1; // pid of foreground child or -1
+static volatile sig_atomic_t fg_killed;     // the timeout fired on it
+
+static void sigint_ignore(int sig) {
+    (void)sig;
+    // ignore in the shell so Ctrl-C doesn’t kill the shell itself
+    write(STDOUT_FILENO, "\n", 1);
+}
+
+static void sigalrm_kill_child(int sig) {
+    (void)sig;
+    if (fg_child > 0) {
+        kill(fg_child, SIGKILL);
+        fg_killed = 1;
+    }
+}
+
+static void install_parent_handlers(void) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigint_ignore;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sa, NULL);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigalrm_kill_child;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGALRM, &sa, NULL);
+
+    // a builtin writing into a closed pipe gets EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+}
+
+static void reset_child_signals(void) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGALRM, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+}
+
+/* ---- test ----
+ * `test` and `[` evaluate in the shell. File predicates go through a
+ * small stat cache that lives until something other than test runs, so
+ * `[ -f x ] && [ -r x ] && [ -s x ]` costs one stat. Permissions are
+ * decided from the cached mode bits, ignoring ACLs. */
+
+#define STAT_SLOTS 8
+
+struct stat_entry {
+    char       *path;
+    bool        followed;           // stat(), else lstat()
+    int         err;                // errno, or 0
+    struct stat st;
+};
+
+static struct stat_entry stat_cache[STAT_SLOTS];
+static unsigned          stat_next;
+
+static void stat_cache_clear(void) {
+    for (int i = 0; i < STAT_SLOTS; i++) {
+        free(stat_cache[i].path);
+        stat_cache[i].path = NULL;
+    }
+}
+
+/* the cached stat (or lstat) of path; NULL with errno set on failure */
+static const struct stat *stat_cached(const char *path, bool follow) {
+    struct stat_entry *e;
+
+    for (int i = 0; i < STAT_SLOTS; i++) {
+        e = &stat_cache[i];
+        if (e->path && e->followed == follow && strcmp(e->path, path) == 0)
+            goto found;
+    }
+    e = &stat_cache[stat_next++ % STAT_SLOTS];
+    free(e->path);
+    e->path = strdup(path);
+    e->followed = follow;
+    e->err = (follow ? stat(path, &e->st) : lstat(path, &e->st)) < 0 ? errno : 0;
+found:
+    errno = e->err;
+    return e->err ? NULL : &e->st;
+}
+
+static bool in_group(gid_t gid) {
+    static gid_t groups[NGROUPS_MAX];
+    static int ngroups = -1;
+
+    if (gid == getegid()) return true;
+    if (ngroups < 0) ngroups = getgroups(NGROUPS_MAX, groups);
+    for (int i = 0; i < ngroups; i++)
+        if (groups[i] == gid) return true;
+    return false;
+}
+
+/* access(2) answered from mode bits; mode is R_OK, W_OK or X_OK */
+static bool st_access(const struct stat *st, int mode) {
+    int shift;
+
+    if (geteuid() == 0)
+        return mode != X_OK || (st->st_mode & 0111) || S_ISDIR(st->st_mode);
+    if (st->st_uid == geteuid()) shift = 6;
+    else if (in_group(st->st_gid)) shift = 3;
+    else shift = 0;
+    int bit = mode == R_OK ? 4 : mode == W_OK ? 2 : 1;
+    return (st->st_mode >> shift) & bit;
+}
+
+struct test_args {
+    char **v;
+    int    n, i;
+    bool   bad;
+};
+
+static int test_or(struct test_args *t);
+
+static bool test_int(struct test_args *t, const char *s, long long *out) {
+    char *end;
+
+    errno = 0;
+    *out = strtoll(s, &end, 10);
+    if (end == s || *end || errno) {
+        fprintf(stderr, "test: %s: integer expected\n", s);
+        t->bad = true;
+        return false;
+    }
+    return true;
+}
+
+static int test_unary(char op, const char *arg) {
+    const struct stat *st;
+
+    switch (op) {
+    case 'z': return !*arg;
+    case 'n': return *arg != '\0';
+    case 't': return isatty(atoi(arg));
+    case 'L':
+    case 'h':
+        st = stat_cached(arg, false);
+        return st && S_ISLNK(st->st_mode);
+    }
+    // an unknown operator is an error even when the file is missing
+    if (!op || !strchr("efdbcpSsugkrwx", op)) return -1;
+    st = stat_cached(arg, true);
+    if (!st) return false;
+    switch (op) {
+    case 'e': return true;
+    case 'f': return S_ISREG(st->st_mode);
+    case 'd': return S_ISDIR(st->st_mode);
+    case 'b': return S_ISBLK(st->st_mode);
+    case 'c': return S_ISCHR(st->st_mode);
+    case 'p': return S_ISFIFO(st->st_mode);
+    case 'S': return S_ISSOCK(st->st_mode);
+    case 's': return st->st_size > 0;
+    case 'u': return (st->st_mode & S_ISUID) != 0;
+    case 'g': return (st->st_mode & S_ISGID) != 0;
+    case 'k': return (st->st_mode & S_ISVTX) != 0;
+    case 'r': return st_access(st, R_OK);
+    case 'w': return st_access(st, W_OK);
+    case 'x': return st_access(st, X_OK);
+    }
+    return -1;
+}
+
+static int test_binary(struct test_args *t, const char *a, const char *op,
+                       const char *b) {
+    long long x, y;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(a, b) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+    if (strcmp(op, "<") == 0) return strcmp(a, b) < 0;
+    if (strcmp(op, ">") == 0) return strcmp(a, b) > 0;
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        const struct stat *sa = stat_cached(a, true);
+        struct stat ca = sa ? *sa : (struct stat){ 0 };   // b may evict a
+        const struct stat *sb = stat_cached(b, true);
+        if (op[1] == 'e')
+            return sa && sb && ca.st_dev == sb->st_dev && ca.st_ino == sb->st_ino;
+        if (!sa || !sb) return op[1] == 'n' ? sa != NULL : sb != NULL;
+        long long d = (long long)(ca.st_mtim.tv_sec - sb->st_mtim.tv_sec) * 1000000000LL +
+                      (ca.st_mtim.tv_nsec - sb->st_mtim.tv_nsec);
+        return op[1] == 'n' ? d > 0 : d < 0;
+    }
+
+    static const char *ops[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+    for (int k = 0; k < 6; k++) {
+        if (strcmp(op, ops[k]) != 0) continue;
+        if (!test_int(t, a, &x) || !test_int(t, b, &y)) return 0;
+        switch (k) {
+        case 0: return x == y;
+        case 1: return x != y;
+        case 2: return x < y;
+        case 3: return x <= y;
+        case 4: return x > y;
+        default: return x >= y;
+        }
+    }
+    return -1;
+}
+
+static bool test_is_binary(const char *op) {
+    static const char *ops[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+        "-nt", "-ot", "-ef", NULL
+    };
+    for (const char **o = ops; *o; o++)
+        if (strcmp(op, *o) == 0) return true;
+    return false;
+}
+
+static int test_primary(struct test_args *t) {
+    char **v = t->v + t->i;
+    int left = t->n - t->i;
+
+    if (left <= 0) {
+        fprintf(stderr, "test: argument expected\n");
+        t->bad = true;
+        return 0;
+    }
+    if (strcmp(v[0], "!") == 0 && left > 1) {
+        t->i++;
+        return !test_primary(t);
+    }
+    if (strcmp(v[0], "(") == 0 && left > 1) {
+        t->i++;
+        int r = test_or(t);
+        if (t->i >= t->n || strcmp(t->v[t->i], ")") != 0) {
+            fprintf(stderr, "test: ')' expected\n");
+            t->bad = true;
+            return 0;
+        }
+        t->i++;
+        return r;
+    }
+    if (left >= 3 && test_is_binary(v[1])) {
+        t->i += 3;
+        return test_binary(t, v[0], v[1], v[2]);
+    }
+    if (left >= 2 && v[0][0] == '-' && v[0][1] && !v[0][2]) {
+        int r = test_unary(v[0][1], v[1]);
+        if (r >= 0) {
+            t->i += 2;
+            return r;
+        }
+        fprintf(stderr, "test: %s: unary operator expected\n", v[0]);
+        t->bad = true;
+        return 0;
+    }
+    t->i++;
+    return v[0][0] != '\0';
+}
+
+static int test_and(struct test_args *t) {
+    int r = test_primary(t);
+    while (!t->bad && t->i < t->n && strcmp(t->v[t->i], "-a") == 0) {
+        t->i++;
+        r = test_primary(t) && r;
+    }
+    return r;
+}
+
+static int test_or(struct test_args *t) {
+    int r = test_and(t);
+    while (!t->bad && t->i < t->n && strcmp(t->v[t->i], "-o") == 0) {
+        t->i++;
+        r = test_and(t) || r;
+    }
+    return r;
+}
+
+/* exit status of `test` / `[` */
+static int test_run(int argc, char **argv) {
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+    if (argc == 1) return 1;
+
+    struct test_args t = { argv + 1, argc - 1, 0, false };
+    int r = test_or(&t);
+    if (!t.bad && t.i < t.n) {
+        fprintf(stderr, "test: %s: unexpected argument\n", t.v[t.i]);
+        t.bad = true;
+    }
+    return t.bad ? 2 : !r;
+}
+
+/* ---- printf ----
+ * A format is compiled once into literal runs and conversions, each
+ * carrying a ready C spec such as "%-8.3lld", and kept in a small cache
+ * keyed by the format string, so a loop printing with the same format
+ * parses it once. */
+
+#define PF_SLOTS 16
+
+struct pf_piece {
+    char        conv;               // 0 for literal text
+    bool        star_width, star_prec;
+    const char *text;               // the literal, or the C spec
+    size_t      len;
+};
+
+struct pf_format {
+    char            *src;
+    struct pf_piece *pieces;
+    int              npieces, nconv;
+    struct strbuf    text;
+};
+
+static struct pf_format pf_cache[PF_SLOTS];
+static pthread_mutex_t  pf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* decode the escape after a backslash at *pp into b, advancing *pp;
+ * false for \c, which ends all output. %b arguments write octal as \0NNN. */
+static bool pf_unescape(const char **pp, struct strbuf *b, bool in_arg) {
+    const char *p = *pp;
+    char c;
+    int v = 0, k = 0;
+
+    switch (*p) {
+    case 'a':  c = '\a'; p++; break;
+    case 'b':  c = '\b'; p++; break;
+    case 'e':  c = '\x1b'; p++; break;
+    case 'f':  c = '\f'; p++; break;
+    case 'n':  c = '\n'; p++; break;
+    case 'r':  c = '\r'; p++; break;
+    case 't':  c = '\t'; p++; break;
+    case 'v':  c = '\v'; p++; break;
+    case '\\': c = '\\'; p++; break;
+    case 'c':
+        if (!in_arg) goto literal;
+        *pp = p + 1;
+        return false;
+    case 'x':
+        for (p++; k < 2 && strchr("0123456789abcdefABCDEF", *p) && *p; k++, p++)
+            v = v * 16 + (*p <= '9' ? *p - '0' : (*p | 0x20) - 'a' + 10);
+        if (!k) goto literal;
+        c = (char)v;
+        break;
+    default:
+        if (*p < '0' || *p > '7') goto literal;
+        if (in_arg && *p == '0') p++;
+        for (; k < 3 && *p >= '0' && *p <= '7'; k++, p++) v = v * 8 + (*p - '0');
+        c = (char)v;
+        break;
+    }
+    sb_put(b, &c, 1);
+    *pp = p;
+    return true;
+literal:
+    sb_put(b, "\\", 1);
+    return true;
+}
+
+static void pf_compile(struct pf_format *f, const char *src) {
+    int cap = 8;
+
+    f->src = strdup(src);
+    f->pieces = malloc((size_t)cap * sizeof(*f->pieces));
+    f->npieces = f->nconv = 0;
+    f->text = (struct strbuf){ 0 };
+    sb_put(&f->text, "", 0);
+
+    for (const char *p = src; *p; ) {
+        struct pf_piece pc = { 0 };
+        size_t start = f->text.len;
+
+        if (*p == '%' && p[1] && p[1] != '%') {
+            const char *spec = p++;
+            sb_put(&f->text, "%", 1);
+            while (*p && strchr("-+ #0", *p)) sb_put(&f->text, p++, 1);
+            if (*p == '*') {
+                pc.star_width = true;
+                sb_put(&f->text, p++, 1);
+            } else {
+                while (*p >= '0' && *p <= '9') sb_put(&f->text, p++, 1);
+            }
+            if (*p == '.') {
+                sb_put(&f->text, p++, 1);
+                if (*p == '*') {
+                    pc.star_prec = true;
+                    sb_put(&f->text, p++, 1);
+                } else {
+                    while (*p >= '0' && *p <= '9') sb_put(&f->text, p++, 1);
+                }
+            }
+            while (*p && strchr("hlLqjzt", *p)) p++;
+            if (!*p || !strchr("sbcdiuoxXeEfFgGaA", *p)) {
+                // not a conversion: keep the text as typed
+                f->text.len = start;
+                sb_put(&f->text, spec, (size_t)(p - spec));
+                pc.len = f->text.len - start;
+            } else {
+                pc.conv = *p++;
+                if (strchr("diuoxX", pc.conv)) sb_put(&f->text, "ll", 2);
+                sb_put(&f->text, strchr("sbc", pc.conv) ? "s" : &pc.conv, 1);
+                pc.len = f->text.len - start;
+                f->nconv++;
+            }
+        } else {
+            // a run of literal text, with escapes decoded now
+            while (*p && !(*p == '%' && p[1] && p[1] != '%')) {
+                if (*p == '%') {
+                    sb_put(&f->text, "%", 1);
+                    p += 1 + (p[1] == '%');
+                } else if (*p == '\\' && p[1]) {
+                    p++;
+                    pf_unescape(&p, &f->text, false);
+                } else {
+                    sb_put(&f->text, p++, 1);
+                }
+            }
+            pc.len = f->text.len - start;
+        }
+        sb_put(&f->text, "", 1);    // NUL-terminate each spec
+        if (f->npieces == cap)
+            f->pieces = realloc(f->pieces, (size_t)(cap *= 2) * sizeof(*f->pieces));
+        f->pieces[f->npieces++] = pc;
+    }
+    // the pieces' text lies back to back, each followed by a NUL
+    const char *t = f->text.p;
+    for (int i = 0; i < f->npieces; i++) {
+        f->pieces[i].text = t;
+        t += f->pieces[i].len + 1;
+    }
+}
+
+static struct pf_format *pf_lookup(const char *src) {
+    struct pf_format *f = &pf_cache[hash_bytes(src, strlen(src)) % PF_SLOTS];
+
+    if (f->src && strcmp(f->src, src) == 0) return f;
+    free(f->src);
+    free(f->pieces);
+    free(f->text.p);
+    pf_compile(f, src);
+    return f;
+}
+
+/* numeric argument; 'c or "c gives the character's code */
+static long long pf_number(const char *s, bool *bad) {
+    char *end;
+
+    if (*s == '\'' || *s == '"') return (unsigned char)s[1];
+    if (!*s) return 0;
+    errno = 0;
+    long long v = strtoll(s, &end, 0);
+    if (*end || errno) {
+        fprintf(stderr, "printf: %s: invalid number\n", s);
+        *bad = true;
+    }
+    return v;
+}
+
+#define PF_EMIT(pc, w, pr, v)                                           \
+    ((pc)->star_width && (pc)->star_prec ? out_printf((pc)->text, w, pr, v) \
+     : (pc)->star_width ? out_printf((pc)->text, w, v)                  \
+     : (pc)->star_prec ? out_printf((pc)->text, pr, v)                  \
+     : out_printf((pc)->text, v))
+
+/* exit status of printf FORMAT [ARG...] */
+static int pf_run(int argc, char **argv) {
+    static struct strbuf arg_buf;
+    bool bad = false, stop = false;
+    int ai = 2;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: printf FORMAT [ARG...]\n");
+        return 2;
+    }
+    // pipeline stages may run printf on several threads at once
+    pthread_mutex_lock(&pf_lock);
+    struct pf_format *f = pf_lookup(argv[1]);
+
+    // the format is reused while arguments remain
+    do {
+        for (int i = 0; i < f->npieces && !stop; i++) {
+            const struct pf_piece *pc = &f->pieces[i];
+            int w = 0, pr = 0;
+
+            if (!pc->conv) {
+                out_put(pc->text, pc->len);
+                continue;
+            }
+            if (pc->star_width) w = (int)pf_number(ai < argc ? argv[ai++] : "", &bad);
+            if (pc->star_prec) pr = (int)pf_number(ai < argc ? argv[ai++] : "", &bad);
+            const char *arg = ai < argc ? argv[ai++] : "";
+
+            switch (pc->conv) {
+            case 'c': {
+                char one[2] = { arg[0], '\0' };
+                PF_EMIT(pc, w, pr, one);
+                break;
+            }
+            case 's':
+                PF_EMIT(pc, w, pr, arg);
+                break;
+            case 'b':
+                arg_buf.len = 0;
+                sb_put(&arg_buf, "", 0);
+                for (const char *p = arg; *p && !stop; ) {
+                    if (*p == '\\' && p[1]) {
+                        p++;
+                        stop = !pf_unescape(&p, &arg_buf, true);
+                    } else {
+                        sb_put(&arg_buf, p++, 1);
+                    }
+                }
+                PF_EMIT(pc, w, pr, arg_buf.p);
+                break;
+            case 'd':
+            case 'i':
+                PF_EMIT(pc, w, pr, pf_number(arg, &bad));
+                break;
+            case 'u': case 'o': case 'x': case 'X':
+                PF_EMIT(pc, w, pr, (unsigned long long)pf_number(arg, &bad));
+                break;
+            default: {
+                char *end;
+                double d = strtod(arg, &end);
+                if (*end) {
+                    fprintf(stderr, "printf: %s: invalid number\n", arg);
+                    bad = true;
+                }
+                PF_EMIT(pc, w, pr, d);
+                break;
+            }
+            }
+        }
+    } while (!stop && f->nconv && ai > 2 && ai < argc);
+    pthread_mutex_unlock(&pf_lock);
+    return bad;
+}
+
+/* ---- read ----
+ * read [-r] [-p PROMPT] [NAME...]: one line of stdin split on $IFS into
+ * the named variables (REPLY by default), the last taking the rest.
+ * Without -r a backslash quotes the next character and a trailing one
+ * joins the next line. */
+
+static int read_run(int argc, char **argv) {
+    struct strbuf line = { 0 };     // per call: read may run on a stage thread
+    char *quoted = NULL;            // line.p[i] came after a backslash
+    size_t quoted_cap = 0;
+    bool raw = false;
+    int i = 1, r;
+
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            raw = true;
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            fputs(argv[++i], stderr);
+        } else {
+            fprintf(stderr, "usage: read [-r] [-p PROMPT] [NAME...]\n");
+            return 2;
+        }
+    }
+
+    // collect the line, dropping backslashes but remembering what they quoted
+    size_t n = 0;
+    for (;;) {
+        size_t from = line.len;
+        r = in_line(&line);
+        if (r < 0 && from == 0) {
+            free(line.p);
+            return 1;
+        }
+        if (quoted_cap < line.len + 1) {
+            quoted_cap = line.len + 256;
+            quoted = realloc(quoted, quoted_cap);
+        }
+        bool joined = false;
+        for (size_t k = from; k < line.len; k++) {
+            if (!raw && line.p[k] == '\\') {
+                if (k + 1 == line.len) {
+                    joined = r == 0;
+                    break;
+                }
+                k++;
+                quoted[n] = 1;
+            } else {
+                quoted[n] = 0;
+            }
+            line.p[n++] = line.p[k];
+        }
+        line.len = n;
+        if (!joined) break;
+    }
+    line.p[n] = '\0';
+
+    const char *ifs = getenv("IFS");
+    if (!ifs) ifs = " \t\n";
+    const char *def[] = { "REPLY" };
+    char **names = i < argc ? argv + i : (char **)def;
+    int nnames = i < argc ? argc - i : 1;
+
+    size_t k = 0;
+    for (int v = 0; v < nnames; v++) {
+        while (k < n && !quoted[k] && strchr(ifs, line.p[k])) k++;
+        size_t start = k, end;
+        if (v == nnames - 1) {
+            end = n;
+            while (end > start && !quoted[end - 1] && strchr(ifs, line.p[end - 1])) end--;
+        } else {
+            while (k < n && (quoted[k] || !strchr(ifs, line.p[k]))) k++;
+            end = k;
+        }
+        char save = line.p[end];
+        line.p[end] = '\0';
+        if (io->assign) {
+            // on a stage thread; a neighbour may be walking environ
+            sb_put(io->assign, names[v], strlen(names[v]) + 1);
+            sb_put(io->assign, line.p + start, end - start + 1);
+        } else {
+            setenv(names[v], line.p + start, 1);
+        }
+        line.p[end] = save;
+    }
+    free(line.p);
+    free(quoted);
+    return r != 0;
+}
+
+__attribute__((noreturn))
+static void exec_child(char **argv, const char *exe);
+
+/* ---- launcher ----
+ * Forking the shell copies its page tables, which grow with the
+ * history, the caches and the arena. So a small helper is forked at
+ * startup, before any of those exist, and external commands are started
+ * by it. The shell installs a command's pipes and redirections around
+ * the request. It then passes the resulting fds, its cwd and the
+ * command's cgroup leaf with SCM_RIGHTS. The helper clones with
+ * CLONE_PARENT, so the command is still the shell's child to wait for.
+ * Requests too big for one message, and anything a forked copy of the
+ * shell starts, fork as before. */
+
+#define LAUNCH_MAX  (128 * 1024)            // argv and environment bytes
+#define LAUNCH_FDS  (MAX_SAVED_FDS + 5)
+#define LAUNCH_CWD  (-1)                    // targets that are not fds
+#define LAUNCH_LEAF (-2)
+
+#define LAUNCH_NONE  ((pid_t)-2)            // not taken: fork it yourself
+#define LAUNCH_REDIR ((pid_t)-3)            // a redirection failed
+
+struct launch_req {
+    int         nfds;                       // passed, one per target
+    int         target[LAUNCH_FDS];
+    int         nclosed;                    // closed in the shell
+    int         closed[LAUNCH_FDS];
+    int         argc, envc;
+    bool        exe;                        // the strings start with it
+    bool        prefixed;
+    struct prio prio;
+    int         oom;                        // INT_MIN: unchanged
+    __typeof__(limit_set) limits;
+    // then the NUL-terminated strings
+};
+
+struct launch_reply {
+    pid_t pid;
+    int   err;
+};
+
+static union {
+    struct launch_req req;
+    char              bytes[sizeof(struct launch_req) + LAUNCH_MAX];
+} launch_buf;
+
+/* in the new child: finish what fork would have inherited, then exec */
+__attribute__((noreturn))
+static void launcher_child(const struct launch_req *q, const int *fds,
+                           char **argv, char **envp, const char *exe) {
+    int top = 3;
+
+    for (int i = 0; i < q->nfds; i++) {
+        if (q->target[i] == LAUNCH_CWD && fchdir(fds[i]) < 0) _exit(126);
+        if (q->target[i] >= top) top = q->target[i] + 1;
+    }
+    // out of the way of every target first, then into place
+    int moved[LAUNCH_FDS];
+    for (int i = 0; i < q->nfds; i++)
+        if ((moved[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, top)) < 0) _exit(126);
+    for (int i = 0; i < q->nfds; i++)
+        if (q->target[i] >= 0 && dup2(moved[i], q->target[i]) < 0) _exit(126);
+    for (int i = 0; i < q->nclosed; i++) close(q->closed[i]);
+
+    memcpy(limit_set, q->limits, sizeof(limit_set));
+    if (limits_apply() < 0 || (q->prefixed && prio_apply(&q->prio) < 0))
+        _exit(1);
+    if (q->oom != INT_MIN && oom_set(0, q->oom) < 0) perror("oom_score_adj");
+    reset_child_signals();
+    environ = envp;                 // and execvp searches its PATH
+    exec_child(argv, exe);
+}
+
+/* start the request in q as a sibling of ours; its pid, or -1 */
+static pid_t launcher_clone(const struct launch_req *q, const int *fds,
+                            size_t len) {
+    const char *s = (const char *)(q + 1), *end = s + len, *exe = NULL;
+    char **argv = malloc((size_t)(q->argc + q->envc + 2) * sizeof(char *));
+    char **envp = argv + q->argc + 1;
+    int leaf = -1;
+
+    if (!argv) return -1;
+    if (q->exe) {
+        exe = s;
+        s += strlen(s) + 1;
+    }
+    for (int i = 0; i < q->argc + q->envc + 1 && s < end; i++) {
+        if (i == q->argc) {
+            argv[i] = NULL;
+            continue;
+        }
+        argv[i] = (char *)s;
+        s += strlen(s) + 1;
+    }
+    envp[q->envc] = NULL;
+    for (int i = 0; i < q->nfds; i++)
+        if (q->target[i] == LAUNCH_LEAF) leaf = fds[i];
+
+    struct clone_args a = {
+        .flags = CLONE_PARENT,
+        .exit_signal = SIGCHLD,
+    };
+    if (leaf >= 0) {
+        a.flags |= CLONE_INTO_CGROUP;
+        a.cgroup = (uint64_t)leaf;
+    }
+    bool placed = true;
+    pid_t pid = -1;
+    if (!cg.no_clone3) {
+        pid = (pid_t)syscall(SYS_clone3, &a, sizeof(a));
+        if (pid < 0 && (errno == ENOSYS || errno == E2BIG || errno == EINVAL))
+            cg.no_clone3 = true;
+    }
+    if (cg.no_clone3) {
+        // no stack given: the child runs on a copy of ours, as in fork
+        pid = (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+        placed = false;
+    }
+    if (pid == 0) {
+        if (!placed && leaf >= 0 && cg_write(leaf, "cgroup.procs", "0") < 0) {
+            fprintf(stderr, "cgroup: %s\n", strerror(errno));
+            _exit(126);
+        }
+        launcher_child(q, fds, argv, envp, exe);
+    }
+    int err = errno;
+    free(argv);
+    errno = err;
+    return pid;
+}
+
+__attribute__((noreturn))
+static void launcher_serve(int sock) {
+    int fds[LAUNCH_FDS];
+    union {
+        struct cmsghdr h;
+        char           b[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+
+    signal(SIGINT, SIG_IGN);        // Ctrl-C is for the foreground job
+    signal(SIGALRM, SIG_DFL);
+    for (;;) {
+        struct iovec iov = { launch_buf.bytes, sizeof(launch_buf) };
+        struct msghdr m = {
+            .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = &ctl, .msg_controllen = sizeof(ctl),
+        };
+        ssize_t r = recvmsg(sock, &m, MSG_CMSG_CLOEXEC);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) _exit(0);       // the shell is gone
+
+        int n = 0;
+        struct cmsghdr *h = CMSG_FIRSTHDR(&m);
+        if (h && h->cmsg_level == SOL_SOCKET && h->cmsg_type == SCM_RIGHTS) {
+            n = (int)((h->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds, CMSG_DATA(h), (size_t)n * sizeof(int));
+        }
+        const struct launch_req *q = &launch_buf.req;
+        struct launch_reply rep = { -1, EPROTO };
+        if ((size_t)r >= sizeof(*q) && n == q->nfds && !(m.msg_flags & MSG_CTRUNC)) {
+            rep.pid = launcher_clone(q, fds, (size_t)r - sizeof(*q));
+            rep.err = rep.pid < 0 ? errno : 0;
+        }
+        for (int i = 0; i < n; i++) close(fds[i]);
+        send(sock, &rep, sizeof(rep), MSG_NOSIGNAL);
+    }
+}
+
+/* fork the helper; the shell works on without it if this fails */
+static void launcher_start(void) {
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) return;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        launcher_serve(sv[1]);
+    }
+    close(sv[1]);
+    // clear of the fds a redirection usually names
+    launcher.fd = pid < 0 ? -1 : fcntl(sv[0], F_DUPFD_CLOEXEC, 10);
+    close(sv[0]);
+    launcher.pid = pid;
+    launcher.owner = getpid();
+}
+
+static bool launch_put(size_t *len, const char *s) {
+    size_t n = strlen(s) + 1;
+    if (n > LAUNCH_MAX - *len) return false;
+    memcpy(launch_buf.bytes + sizeof(struct launch_req) + *len, s, n);
+    *len += n;
+    return true;
+}
+
+/* start argv (exe its resolved path, or NULL) through the launcher, with
+ * c's redirections if c is given. std[0..2], where not -1, replace the
+ * shell's stdin, stdout and stderr underneath them. The pid, -1 with
+ * errno if the clone failed, LAUNCH_REDIR after a message, or
+ * LAUNCH_NONE when the caller has to fork it itself. */
+static pid_t launch(char **argv, const char *exe, const struct command *c,
+                    const int *std, const struct prio *prio, int oom,
+                    const struct cg_leaf *leaf) {
+    struct launch_req *q = &launch_buf.req;
+    size_t len = 0;
+
+    if (launcher.fd < 0 || getpid() != launcher.owner) return LAUNCH_NONE;
+    memset(q, 0, sizeof(*q));
+    q->exe = exe != NULL;
+    if (exe && !launch_put(&len, exe)) return LAUNCH_NONE;
+    for (char **a = argv; *a; a++, q->argc++)
+        if (!launch_put(&len, *a)) return LAUNCH_NONE;
+    for (char **e = environ; *e; e++, q->envc++)
+        if (!launch_put(&len, *e)) return LAUNCH_NONE;
+    if (prio) {
+        q->prefixed = true;
+        q->prio = *prio;
+    }
+    q->oom = oom;
+    memcpy(q->limits, limit_set, sizeof(limit_set));
+
+    int fds[LAUNCH_FDS];
+    int targets[3 + MAX_SAVED_FDS] = { 0, 1, 2 }, nt = 3, top = 3;
+    for (int i = 0; c && i < c->nredirs; i++) {
+        int fd = c->redirs[i].fd, k = 0;
+        if (fd == launcher.fd || (leaf && fd == leaf->fd)) return LAUNCH_NONE;
+        while (k < nt && targets[k] != fd) k++;
+        if (k == nt && nt < 3 + MAX_SAVED_FDS) targets[nt++] = fd;
+        if (fd >= top) top = fd + 1;
+    }
+
+    // lay the child's fds out in the shell's own table, as a forked
+    // child would, and put ours back once they are sent
+    struct saved_fds saved = { 0 };
+    for (int fd = 0; std && fd < 3; fd++)
+        if (std[fd] >= 0 && (!redir_save(&saved, fd) || dup2(std[fd], fd) < 0)) {
+            redirs_restore(&saved);
+            return LAUNCH_NONE;
+        }
+    if (c && redirs_apply(c, &saved) < 0) return LAUNCH_REDIR;
+    // opened now, so that no target can be standing in for it
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd >= 0 && cwd < top) {
+        int fd = fcntl(cwd, F_DUPFD_CLOEXEC, top);
+        close(cwd);
+        cwd = fd;
+    }
+    if (cwd < 0) {
+        redirs_restore(&saved);
+        return LAUNCH_NONE;
+    }
+    for (int i = 0; i < nt; i++) {
+        if (fcntl(targets[i], F_GETFD) < 0) {
+            q->closed[q->nclosed++] = targets[i];
+            continue;
+        }
+        q->target[q->nfds] = targets[i];
+        fds[q->nfds++] = targets[i];
+    }
+    q->target[q->nfds] = LAUNCH_CWD;
+    fds[q->nfds++] = cwd;
+    if (leaf && leaf->fd >= 0) {
+        q->target[q->nfds] = LAUNCH_LEAF;
+        fds[q->nfds++] = leaf->fd;
+    }
+
+    union {
+        struct cmsghdr h;
+        char           b[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+    struct iovec iov = { launch_buf.bytes, sizeof(*q) + len };
+    struct msghdr m = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = &ctl, .msg_controllen = CMSG_SPACE((size_t)q->nfds * sizeof(int)),
+    };
+    struct cmsghdr *h = CMSG_FIRSTHDR(&m);
+    h->cmsg_level = SOL_SOCKET;
+    h->cmsg_type = SCM_RIGHTS;
+    h->cmsg_len = CMSG_LEN((size_t)q->nfds * sizeof(int));
+    memcpy(CMSG_DATA(h), fds, (size_t)q->nfds * sizeof(int));
+
+    ssize_t r;
+    while ((r = sendmsg(launcher.fd, &m, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    int err = errno;
+    redirs_restore(&saved);
+    close(cwd);
+    if (r < 0 && err == EMSGSIZE) return LAUNCH_NONE;  // a small socket buffer
+
+    struct launch_reply rep;
+    if (r >= 0)
+        while ((r = recv(launcher.fd, &rep, sizeof(rep), 0)) < 0 && errno == EINTR)
+            ;
+    if (r != (ssize_t)sizeof(rep)) {
+        // the helper is gone; fork from here on
+        close(launcher.fd);
+        launcher.fd = -1;
+        return LAUNCH_NONE;
+    }
+    errno = rep.err;
+    return rep.pid;
+}
+
+/* ---- memo ----
+ * `memo [--fast] [--env NAME]... [--inputs FILE... --] COMMAND...` runs
+ * a deterministic command once and replays it after that. The key is a
+ * 128-bit FNV-1a hash of the argv, the working directory, the declared
+ * variables, the identity of the resolved binary (device, inode, size,
+ * mtime) and the input files' contents, or with --fast only their
+ * identity. An entry is a directory under ~/.cache/shell-memo holding
+ * out, err and status. A hit is copied out with copy_file_range. A miss
+ * runs with stdin from /dev/null and is captured into a fresh entry that
+ * is renamed into place. Output shows once the command finishes. Runs
+ * killed by a signal are not kept. */
+
+typedef unsigned __int128 u128;
+
+#define FNV128_BASIS (((u128)0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL)
+#define FNV128_PRIME (((u128)1 << 88) | 0x13b)
+
+static u128 fnv128(u128 h, const void *p, size_t n) {
+    const unsigned char *b = p;
+    while (n--) {
+        h ^= *b++;
+        h *= FNV128_PRIME;
+    }
+    return h;
+}
+
+static u128 fnv128_str(u128 h, const char *s) {
+    return fnv128(h, s, strlen(s) + 1);     // the NUL keeps fields apart
+}
+
+static u128 memo_identity(u128 h, const struct stat *st) {
+    uint64_t id[5] = { st->st_dev, st->st_ino, (uint64_t)st->st_size,
+                       (uint64_t)st->st_mtim.tv_sec, (uint64_t)st->st_mtim.tv_nsec };
+    return fnv128(h, id, sizeof(id));
+}
+
+/* an input file into h; -1 if it cannot be read */
+static int memo_input(u128 *h, const char *path, bool fast) {
+    struct stat st;
+    char buf[65536];
+
+    *h = fnv128_str(*h, path);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "memo: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    if (fast) {
+        *h = memo_identity(*h, &st);
+    } else {
+        ssize_t r;
+        while ((r = read(fd, buf, sizeof(buf))) > 0) *h = fnv128(*h, buf, (size_t)r);
+        *h = fnv128(*h, &st.st_size, sizeof(st.st_size));
+    }
+    close(fd);
+    return 0;
+}
+
+/* all of src to dst, in the kernel where it can be */
+static void memo_replay(int src, int dst) {
+    char buf[65536];
+    off_t off = 0;
+    ssize_t r;
+
+    while ((r = copy_file_range(src, &off, dst, NULL, SIZE_MAX >> 1, 0)) > 0)
+        ;
+    if (r < 0)                      // a pipe, a tty, or an old kernel
+        while ((r = pread(src, buf, sizeof(buf), off)) > 0) {
+            write_all(dst, buf, (size_t)r);
+            off += r;
+        }
+}
+
+static int memo_dir(char *path, size_t n) {
+    const char *cache = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+
+    if (cache && *cache) snprintf(path, n, "%s/shell-memo", cache);
+    else if (home) snprintf(path, n, "%s/.cache/shell-memo", home);
+    else return -1;
+    // create it a level at a time; existing ones are fine
+    for (char *p = path + 1; ; p++) {
+        if (*p != '/' && *p) continue;
+        char c = *p;
+        *p = '\0';
+        if (mkdir(path, 0700) < 0 && errno != EEXIST) return -1;
+        if (!(*p = c)) return 0;
+    }
+}
+
+static int memo_run(int argc, char **argv) {
+    bool fast = false;
+    const char **env = calloc((size_t)argc, sizeof(char *));
+    int nenv = 0, i = 1, status = 2;
+    u128 h = FNV128_BASIS;
+    char exe_buf[PATH_MAX], cwd[PATH_MAX], root[PATH_MAX], entry[PATH_MAX + 64],
+         tmp[PATH_MAX + 64], file[PATH_MAX + 80];
+
+    // options first: the inputs are hashed once the command is known
+    int inputs = 0, ninputs = 0;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "--fast") == 0) {
+            fast = true;
+        } else if (strcmp(argv[i], "--env") == 0 && i + 1 < argc) {
+            env[nenv++] = argv[++i];
+        } else if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(argv[i], "--inputs") == 0) {
+            inputs = i + 1;
+            while (i + 1 < argc && strcmp(argv[i + 1], "--") != 0) i++, ninputs++;
+            if (++i == argc) goto usage;    // the "--"
+        } else {
+            goto usage;
+        }
+    }
+    if (i == argc) goto usage;
+
+    char **cmd = argv + i;
+    // a name with a '/' is a path already; the command cache has only PATH
+    const char *exe = strchr(cmd[0], '/') ? cmd[0]
+                    : cmd_lookup(cmd[0], exe_buf, sizeof(exe_buf));
+    struct stat st;
+    if (!exe || stat(exe, &st) < 0) {
+        fprintf(stderr, "memo: %s: not found\n", cmd[0]);
+        status = 127;
+        goto out;
+    }
+    h = fnv128_str(h, "memo1");
+    for (char **a = cmd; *a; a++) h = fnv128_str(h, *a);
+    h = fnv128_str(h, getcwd(cwd, sizeof(cwd)) ? cwd : "");
+    for (int k = 0; k < nenv; k++) {
+        const char *v = getenv(env[k]);
+        h = fnv128_str(h, env[k]);
+        h = v ? fnv128_str(h, v) : fnv128(h, "\1", 1);  // unset is not ""
+    }
+    h = fnv128_str(h, exe);
+    h = memo_identity(h, &st);
+    for (int k = 0; k < ninputs; k++)
+        if (memo_input(&h, argv[inputs + k], fast) < 0) {
+            status = 1;
+            goto out;
+        }
+
+    if (memo_dir(root, sizeof(root)) < 0) {
+        fprintf(stderr, "memo: no cache directory\n");
+        status = 1;
+        goto out;
+    }
+    snprintf(entry, sizeof(entry), "%s/%016llx%016llx", root,
+             (unsigned long long)(h >> 64), (unsigned long long)h);
+
+    // hit: copy it out
+    int fds[3];
+    const char *names[3] = { "out", "err", "status" };
+    for (int k = 0; k < 3; k++) {
+        snprintf(file, sizeof(file), "%s/%s", entry, names[k]);
+        fds[k] = open(file, O_RDONLY | O_CLOEXEC);
+    }
+    if (fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0) {
+        char sbuf[16] = "";
+        if (pread(fds[2], sbuf, sizeof(sbuf) - 1, 0) > 0) {
+            fflush(stdout);
+            out_flush();
+            memo_replay(fds[0], io->out);
+            memo_replay(fds[1], STDERR_FILENO);
+            status = atoi(sbuf);
+            for (int k = 0; k < 3; k++) close(fds[k]);
+            goto out;
+        }
+    }
+    for (int k = 0; k < 3; k++)
+        if (fds[k] >= 0) close(fds[k]);
+
+    // miss: run it into a private entry, then publish that
+    static unsigned memo_seq;
+    snprintf(tmp, sizeof(tmp), "%s/.tmp.%d.%u", root, (int)getpid(), memo_seq++);
+    if (mkdir(tmp, 0700) < 0) {
+        fprintf(stderr, "memo: %s: %s\n", tmp, strerror(errno));
+        status = 1;
+        goto out;
+    }
+    for (int k = 0; k < 2; k++) {
+        snprintf(file, sizeof(file), "%s/%s", tmp, names[k]);
+        fds[k] = open(file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    }
+    fflush(stdout);
+    out_flush();
+    int null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int std[3] = { null, fds[0], fds[1] };
+    pid_t pid = -1;
+    if (null >= 0 && fds[0] >= 0 && fds[1] >= 0) {
+        pid = launch(cmd, exe, NULL, std, NULL, INT_MIN, NULL);
+        if (pid == LAUNCH_NONE) pid = fork();
+    }
+    if (pid == 0) {
+        reset_child_signals();
+        dup2(null, STDIN_FILENO);
+        dup2(fds[0], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        if (limits_apply() < 0) _exit(1);
+        exec_child(cmd, exe);
+    }
+    if (null >= 0) close(null);
+    int ws = 0;
+    if (pid < 0 || waitpid(pid, &ws, 0) < 0) {
+        perror("memo");
+        ws = W_EXITCODE(1, 0);
+    }
+    memo_replay(fds[0], io->out);
+    memo_replay(fds[1], STDERR_FILENO);
+    for (int k = 0; k < 2; k++)
+        if (fds[k] >= 0) close(fds[k]);
+    status = WIFSIGNALED(ws) ? 128 + WTERMSIG(ws) : WEXITSTATUS(ws);
+
+    char sbuf[16];
+    snprintf(file, sizeof(file), "%s/status", tmp);
+    int sfd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    int len = snprintf(sbuf, sizeof(sbuf), "%d\n", status);
+    bool keep = pid > 0 && !WIFSIGNALED(ws) && sfd >= 0 &&
+                write(sfd, sbuf, (size_t)len) == len;
+    if (sfd >= 0) close(sfd);
+    // losing the race to another shell, or not keeping it, leaves tmp
+    if (!keep || rename(tmp, entry) < 0) {
+        for (int k = 0; k < 3; k++) {
+            snprintf(file, sizeof(file), "%s/%s", tmp, names[k]);
+            unlink(file);
+        }
+        rmdir(tmp);
+    }
+    goto out;
+
+usage:
+    fprintf(stderr, "usage: memo [--fast] [--env NAME]... [--inputs FILE... --] "
+                    "COMMAND...\n");
+out:
+    free(env);
+    return status;
+}
+
+/* ---- builtins ---- */
+
+static int source_file(const char *path);
+
+/* run argv as a builtin; false if it is not one */
+static bool run_builtin(int argc, char **argv) {
+    if (strcmp(argv[0], "exit") == 0) {
+        out_put("\n", 1);
+        out_flush();
+        fflush(stderr);
+        exit(argc > 1 ? atoi(argv[1]) : last_status);
+    }
+
+    if (strcmp(argv[0], "return") == 0) {
+        if (!nframes) {
+            fprintf(stderr, "return: not in a function\n");
+            last_status = 1;
+            return true;
+        }
+        if (argc > 1) last_status = atoi(argv[1]);
+        returning = true;
+        return true;
+    }
+
+    last_status = 0;
+
+    if (strcmp(argv[0], "pwd") == 0) {
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd)))
+            out_printf("%s\n", cwd);
+        else {
+            perror("pwd");
+            last_status = 1;
+        }
+        return true;
+    }
+
+    if (strcmp(argv[0], "cd") == 0) {
+        if (change_dir(argc > 1 ? argv[1] : NULL, "cd") < 0)
+            last_status = 1;
+        return true;
+    }
+
+    if (strcmp(argv[0], "pushd") == 0) {
+        if (dirs_push(argc, argv) < 0) last_status = 1;
+        return true;
+    }
+
+    if (strcmp(argv[0], "popd") == 0) {
+        if (dirs_pop(argc, argv) < 0) last_status = 1;
+        return true;
+    }
+
+    if (strcmp(argv[0], "dirs") == 0) {
+        if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+            while (dir_depth > 0) free(dir_stack[--dir_depth]);
+            return true;
+        }
+        dirs_print(argc > 1 && strcmp(argv[1], "-v") == 0);
+        return true;
+    }
+
+    if (strcmp(argv[0], "z") == 0) {
+        char target[PATH_MAX];
+        if (argc < 2) {
+            z_list();
+            return true;
+        }
+        const char *dir = z_best(argv + 1, argc - 1);
+        if (!dir) {
+            fprintf(stderr, "z: no match\n");
+            last_status = 1;
+            return true;
+        }
+        // the map may be replaced by the visit change_dir records
+        snprintf(target, sizeof(target), "%s", dir);
+        if (change_dir(target, "z") < 0) last_status = 1;
+        return true;
+    }
+
+    if (strcmp(argv[0], "echo") == 0) {
+        for (int i = 1; i < argc; i++) {
+            if (i > 1) out_put(" ", 1);
+            out_ref(argv[i], strlen(argv[i]));
+        }
+        out_put("\n", 1);
+        return true;
+    }
+
+    if (strcmp(argv[0], "env") == 0) {
+        if (argc == 1) {
+            for (char **e = environ; *e; ++e) {
+                out_ref(*e, strlen(*e));
+                out_put("\n", 1);
+            }
+        } else {
+            for (int i = 1; i < argc; ++i) {
+                const char *v = getenv(argv[i]);
+                if (v) out_printf("%s\n", v);
+                else last_status = 1;
+            }
+        }
+        return true;
+    }
+
+    if (strcmp(argv[0], "history") == 0) {
+        size_t from = 0, len;
+        hist_sync();
+        if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+            size_t *hits;
+            size_t n = hist_search_all(argv[2],
+                                       strlen(argv[2]), &hits);
+            for (size_t k = 0; k < n; k++) {
+                const char *s = hist_entry(hits[k], &len);
+                out_printf("%5zu  %.*s\n", hits[k] + 1, (int)len, s);
+            }
+            free(hits);
+            return true;
+        }
+        if (argc > 1) {
+            size_t last = strtoul(argv[1], NULL, 10);
+            if (last < hist.count) from = hist.count - last;
+        }
+        for (size_t i = from; i < hist.count; i++) {
+            const char *s = hist_entry(i, &len);
+            out_printf("%5zu  ", i + 1);
+            out_ref(s, len);
+            out_put("\n", 1);
+        }
+        return true;
+    }
+
+    if (strcmp(argv[0], "hash") == 0) {
+        char exe[PATH_MAX];
+        if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+            cmd_forget();
+            return true;
+        }
+        for (int i = 1; i < argc; i++) {
+            if (cmd_lookup(argv[i], exe, sizeof(exe)))
+                out_printf("%s\n", exe);
+            else {
+                fprintf(stderr, "hash: %s: not found\n", argv[i]);
+                last_status = 1;
+            }
+        }
+        return true;
+    }
+
+    if (strcmp(argv[0], "setenv") == 0) {
+        if (argc < 2) {
+            fprintf(stderr, "usage: setenv NAME=VALUE\n");
+            last_status = 2;
+            return true;
+        }
+        char *eq = strchr(argv[1], '=');
+        if (!eq) {
+            fprintf(stderr, "usage: setenv NAME=VALUE\n");
+            last_status = 2;
+            return true;
+        }
+        *eq = '\0';
+        const char *name = argv[1];
+        const char *val  = eq + 1;
+        if (setenv(name, val, 1) != 0) {
+            perror("setenv");
+            last_status = 1;
+        } else if (rc.active) {
+            rc_var(name)->set = true;
+        }
+        return true;
+    }
+
+    if (strcmp(argv[0], "printf") == 0) {
+        last_status = pf_run(argc, argv);
+        return true;
+    }
+
+    if (strcmp(argv[0], "read") == 0) {
+        last_status = read_run(argc, argv);
+        return true;
+    }
+
+    if (strcmp(argv[0], "memo") == 0) {
+        last_status = memo_run(argc, argv);
+        return true;
+    }
+
+    if (strcmp(argv[0], "ulimit") == 0) {
+        last_status = ulimit_run(argc, argv);
+        return true;
+    }
+
+    if (strcmp(argv[0], "prlimit") == 0) {
+        last_status = prlimit_run(argc, argv);
+        return true;
+    }
+
+    if (strcmp(argv[0], "cgroup") == 0) {
+        last_status = cgroup_run(argc, argv);
+        return true;
+    }
+
+    if (strcmp(argv[0], "job-oom") == 0) {
+        last_status = job_oom_run(argc, argv);
+        return true;
+    }
+
+    if (strcmp(argv[0], "nice") == 0 || strcmp(argv[0], "ionice") == 0 ||
+        strcmp(argv[0], "sched") == 0) {
+        prio_show(argv[0]);         // with a command, run_command took it
+        return true;
+    }
+
+    if (strcmp(argv[0], "test") == 0 || strcmp(argv[0], "[") == 0) {
+        last_status = test_run(argc, argv);
+        return true;
+    }
+
+    if (strcmp(argv[0], "source") == 0 || strcmp(argv[0], ".") == 0) {
+        if (argc < 2) {
+            fprintf(stderr, "usage: %s FILE\n", argv[0]);
+            last_status = 2;
+            return true;
+        }
+        if (source_file(argv[1]) < 0) last_status = 1;
+        return true;
+    }
+
+    if (strcmp(argv[0], "jobs") == 0) {
+        jobs_reap();
+        for (int i = 0; i < MAX_JOBS; i++)
+            if (jobs[i].id)
+                out_printf("[%d] %d  %s\n", jobs[i].id, jobs[i].pid,
+                           jobs[i].cmd);
+        return true;
+    }
+
+    if (strcmp(argv[0], "alias") == 0) {
+        if (argc == 1) {
+            for (int b = 0; b < ALIAS_BUCKETS; b++)
+                for (struct alias *a = aliases[b]; a; a = a->next)
+                    out_printf("alias %s='%s'\n", a->name, a->value);
+            return true;
+        }
+        for (int i = 1; i < argc; i++) {
+            char *eq = strchr(argv[i], '=');
+            if (eq) {
+                *eq = '\0';
+                alias_set(argv[i], eq + 1);
+                continue;
+            }
+            struct alias *a = *alias_slot(argv[i]);
+            if (a) {
+                out_printf("alias %s='%s'\n", a->name, a->value);
+            } else {
+                fprintf(stderr, "alias: %s: not found\n", argv[i]);
+                last_status = 1;
+            }
+        }
+        return true;
+    }
+
+    if (strcmp(argv[0], "unalias") == 0) {
+        if (argc > 1 && strcmp(argv[1], "-a") == 0) {
+            for (int b = 0; b < ALIAS_BUCKETS; b++)
+                while (aliases[b]) alias_unset(aliases[b]->name);
+            return true;
+        }
+        for (int i = 1; i < argc; i++) {
+            if (!alias_unset(argv[i])) {
+                fprintf(stderr, "unalias: %s: not found\n", argv[i]);
+                last_status = 1;
+            }
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/* ---- execution ---- */
+
+/* in a child: become argv; exe is its path from the command cache */
+__attribute__((noreturn))
+static void exec_child(char **argv, const char *exe) {
+    if (exe) execv(exe, argv);
+    execvp(argv[0], argv);
+    // if exec failed:
+    perror("execvp");
+    _exit(127);
+}
+
+/* last_status from how a child ended */
+static void set_child_status(int status) {
+    last_status = WIFSIGNALED(status)
+        ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+        fprintf(stderr, "An error occurred.\n");
+}
+
+/* fork and exec argv, waiting for it unless it runs in the background;
+ * prio, if any, is applied in the child */
+static void run_external(char **argv, const struct command *c,
+                         const struct prio *prio) {
+    // resolve through the command cache before forking so the
+    // parent keeps what it learns
+    char exe_buf[PATH_MAX];
+    const char *exe = cmd_lookup(argv[0], exe_buf, sizeof(exe_buf));
+
+    // 4. The parent process should wait for the child to complete
+    //    unless it's a background process
+    fflush(stdout);                // keep builtin output ahead of the child's
+    in_release();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct cg_leaf leaf = cg_start();
+    pid_t pid = launch(argv, exe, c, NULL, prio,
+                       c->background ? oom_background : INT_MIN, &leaf);
+    if (pid == LAUNCH_NONE) pid = cg_fork(&leaf, true);
+    cg_started(&leaf);
+    if (pid < 0) {
+        if (pid != LAUNCH_REDIR) perror("fork");
+        if (leaf.id) cg_finish(leaf.id, cg.last, sizeof(cg.last));
+        last_status = 1;
+        return;
+    }
+
+    if (pid == 0) {
+        // ---- child ----
+        reset_child_signals();
+
+        // apply redirections if requested
+        if (redirs_apply(c, NULL) < 0 || limits_apply() < 0 ||
+            (prio && prio_apply(prio) < 0))
+            _exit(1);
+        if (c->background && oom_set(0, oom_background) < 0)
+            perror("oom_score_adj");
+        exec_child(argv, exe);
+    }
+
+    // ---- parent ----
+    if (!c->background) {
+        fg_killed = 0;
+        fg_child = pid;
+        alarm(10);                 // Task 5: kill child after 10s if still running
+        int status;
+        struct rusage ru;
+        if (wait4(pid, &status, 0, &ru) < 0) {
+            perror("waitpid");
+        } else {
+            set_child_status(status);
+            if (rec.fd >= 0) {
+                char cmd[REC_CMD_MAX];
+                rec_cmd(argv, cmd);
+                rec_add(cmd, pid, status, fg_killed ? REC_TIMED_OUT : 0, &start, &ru);
+            }
+        }
+        alarm(0);                  // cancel timeout
+        fg_child = -1;
+        if (leaf.id) cg_finish(leaf.id, cg.last, sizeof(cg.last));
     } else {
-        snprintf(dst, n, "%s", src);
+        struct job *j = job_add(pid, argv);
+        if (j) j->cg = leaf.id;
+        printf("[%d] started pid %d\n", j ? j->id : 0, pid);
+    }
+}
+
+/* run a function call in a forked copy of the shell */
+static void function_background(const struct function *f, int argc, char **argv,
+                                const struct command *c) {
+    fflush(stdout);
+    in_release();                   // or its children rewind our input
+    struct cg_leaf leaf = cg_start();
+    pid_t pid = cg_fork(&leaf, false);
+    cg_started(&leaf);
+    if (pid < 0) {
+        perror("fork");
+        if (leaf.id) cg_finish(leaf.id, cg.last, sizeof(cg.last));
+        last_status = 1;
+        return;
+    }
+    if (pid == 0) {
+        interactive = false;
+        if (redirs_apply(c, NULL) < 0 || limits_apply() < 0) _exit(1);
+        if (oom_set(0, oom_background) < 0) perror("oom_score_adj");
+        function_call(f, argc, argv);
+        out_flush();
+        rec_flush(true);
+        _exit(last_status);
+    }
+    struct job *j = job_add(pid, argv);
+    if (j) j->cg = leaf.id;
+    printf("[%d] started pid %d\n", j ? j->id : 0, pid);
+}
+
+static bool run_if_met(const struct command *c) {
+    return c->run_if == RUN_ALWAYS ||
+           (c->run_if == RUN_IF_OK) == (last_status == 0);
+}
+
+static void run_command(const struct command *c) {
+    int argc;
+
+    if (!run_if_met(c)) return;
+
+    if (c->func_name) {
+        function_define(c);
+        last_status = 0;
+        return;
+    }
+
+    char **argv = expand_command(c, &argc);
+    struct saved_fds saved = { 0 };
+    struct prio prio;
+
+    // after nice, ionice or sched only an external command can follow
+    int skip = prio_prefix(argc, argv, &prio);
+    if (skip) {
+        if (skip < 0) {
+            last_status = 2;
+            return;
+        }
+        stat_cache_clear();
+        run_external(argv + skip, c, &prio);
+        return;
+    }
+
+    const struct function *f = argc ? function_find(argv[0]) : NULL;
+
+    // functions come first, then builtins, which always run in the
+    // shell itself, '&' or not
+    if (f && c->background) {
+        function_background(f, argc, argv, c);
+        return;
+    }
+    if (argc == 0 || f || is_builtin(argv[0])) {
+        fflush(stdout);             // stdio output predates the redirection
+        if (redirs_apply(c, &saved) < 0) {
+            last_status = 1;
+            return;
+        }
+        if (argc == 0) {            // redirections alone: create the files
+            last_status = 0;
+        } else if (f) {
+            function_call(f, argc, argv);
+        } else {
+            if (rc.active) rc_note_command(argc, argv);
+            // only test itself can keep its stat cache: anything else may
+            // change the files it describes
+            if (strcmp(argv[0], "test") != 0 && strcmp(argv[0], "[") != 0)
+                stat_cache_clear();
+            struct timespec start;
+            struct rusage before, ru;
+            char cmd[REC_CMD_MAX];
+            if (rec.fd >= 0) {          // before the builtin edits argv
+                rec_cmd(argv, cmd);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                getrusage(RUSAGE_THREAD, &before);
+            }
+            run_builtin(argc, argv);
+            out_flush();
+            if (rec.fd >= 0) {
+                rusage_since(&before, &ru);
+                rec_add(cmd, 0, W_EXITCODE(last_status, 0), REC_BUILTIN, &start, &ru);
+            }
+        }
+        redirs_restore(&saved);
+        return;
+    }
+    stat_cache_clear();
+    run_external(argv, c, NULL);
+}
+
+/* ---- pipelines ----
+ * Every stage is expanded up front by the shell thread, since the arena
+ * is not thread-safe. External commands, functions and builtins that
+ * change shell state run in forked children. A foreground builtin that
+ * only moves data (echo, printf, pwd, env, dirs, read) runs instead on a
+ * thread whose I/O context reads and writes its pipe ends, which saves a
+ * process per builtin stage. Two such threads next to each other skip
+ * the kernel and share a ring; a pipe is used only where a process is on
+ * one side. */
+
+#define MAX_STAGES 32
+
+struct stage {
+    const struct command  *c;
+    char                 **argv;
+    int                    argc;
+    const struct function *f;
+    struct prio            prio;
+    bool                   prefixed;        // by nice etc.: external
+    int                    in, out;         // pipe ends, -1 to inherit
+    struct ring           *ring_in, *ring_out;
+    pid_t                  pid;             // forked stage
+    bool                   threaded;
+    pthread_t              thread;
+    int                    status;
+    struct rusage          ru;              // a threaded stage's CPU
+    struct io              io;
+    struct inbuf           inb;
+    struct strbuf          assign;          // what a threaded read sets
+};
+
+static bool builtin_threadable(const char *name) {
+    static const char *names[] = {
+        "dirs", "echo", "env", "printf", "pwd", "read", NULL
+    };
+    for (const char **b = names; *b; b++)
+        if (strcmp(*b, name) == 0) return true;
+    return false;
+}
+
+static void *stage_thread(void *arg) {
+    struct stage *st = arg;
+
+    struct rusage before;
+
+    io = &st->io;
+    getrusage(RUSAGE_THREAD, &before);
+    run_builtin(st->argc, st->argv);
+    out_flush();
+    st->status = last_status;
+    rusage_since(&before, &st->ru);
+    // closing our ends is what lets the neighbours see EOF
+    if (st->in >= 0) close(st->in);
+    if (st->out >= 0) close(st->out);
+    if (st->ring_in) ring_close(st->ring_in, true);
+    if (st->ring_out) ring_close(st->ring_out, false);
+    free(st->io.segs);
+    free(st->io.bytes.p);
+    return NULL;
+}
+
+static void stage_fork(struct stage *st, const int *fds, int nfds,
+                       const struct cg_leaf *leaf) {
+    char exe_buf[PATH_MAX];
+    const char *exe = NULL;
+    bool builtin = st->argc && !st->f && !st->prefixed && is_builtin(st->argv[0]);
+
+    if (st->argc && !st->f && !builtin)
+        exe = cmd_lookup(st->argv[0], exe_buf, sizeof(exe_buf));
+
+    bool exec_only = st->argc && !st->f && !builtin;
+    int std[3] = { st->in, st->out, -1 };
+    pid_t pid = exec_only
+        ? launch(st->argv, exe, st->c, std, st->prefixed ? &st->prio : NULL,
+                 INT_MIN, leaf)
+        : LAUNCH_NONE;
+    if (pid == LAUNCH_NONE) pid = cg_fork(leaf, exec_only);
+    if (pid < 0) {
+        if (pid != LAUNCH_REDIR) perror("fork");
+        st->status = 1;
+        return;
+    }
+    if (pid == 0) {
+        reset_child_signals();
+        if (st->in >= 0) {
+            dup2(st->in, STDIN_FILENO);
+            in.pos = in.len = 0;    // the shell's read-ahead is not ours
+        }
+        if (st->out >= 0) dup2(st->out, STDOUT_FILENO);
+        for (int i = 0; i < nfds; i++) close(fds[i]);
+        if (redirs_apply(st->c, NULL) < 0 || limits_apply() < 0 ||
+            (st->prefixed && prio_apply(&st->prio) < 0))
+            _exit(1);
+        if (!st->argc) _exit(0);
+        if (!st->f && !builtin) exec_child(st->argv, exe);
+
+        interactive = false;
+        if (st->f) function_call(st->f, st->argc, st->argv);
+        else run_builtin(st->argc, st->argv);
+        out_flush();
+        rec_flush(true);
+        _exit(last_status);
+    }
+    st->pid = pid;
+}
+
+/* run n piped commands and wait for them all */
+static void pipeline_exec(const struct command *c, int n, bool timed) {
+    int fds[2 * MAX_STAGES], nfds = 0;
+    struct stage *st = arena_alloc((size_t)n * sizeof(*st));
+
+    memset(st, 0, (size_t)n * sizeof(*st));
+    for (int i = 0; i < n; i++) {
+        st[i].c = &c[i];
+        st[i].argv = expand_command(&c[i], &st[i].argc);
+        st[i].in = st[i].out = -1;
+        int skip = prio_prefix(st[i].argc, st[i].argv, &st[i].prio);
+        if (skip < 0) {
+            st[i].status = 2;       // never started
+            continue;
+        }
+        st[i].argv += skip;
+        st[i].argc -= skip;
+        st[i].prefixed = skip > 0;
+        st[i].f = st[i].argc && !skip ? function_find(st[i].argv[0]) : NULL;
+        st[i].threaded = st[i].argc && !st[i].f && !skip && !c[i].nredirs &&
+                         builtin_threadable(st[i].argv[0]);
+    }
+    for (int i = 0; i + 1 < n; i++) {
+        int p[2];
+        if (st[i].threaded && st[i + 1].threaded) {
+            st[i].ring_out = st[i + 1].ring_in = calloc(1, sizeof(struct ring));
+            continue;
+        }
+        if (pipe2(p, O_CLOEXEC) < 0) {
+            perror("pipe");
+            while (nfds) close(fds[--nfds]);
+            for (int k = 0; k < i; k++) free(st[k].ring_out);
+            last_status = 1;
+            return;
+        }
+        st[i].out = fds[nfds++] = p[1];
+        st[i + 1].in = fds[nfds++] = p[0];
+    }
+
+    fflush(stdout);
+    in_release();
+    stat_cache_clear();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // fork before any stage thread exists; the parent's copies of a
+    // forked stage's pipe ends are closed once it has them. The forked
+    // stages share one leaf.
+    pid_t last_pid = -1;
+    struct cg_leaf leaf = { -1, 0 };
+    for (int i = 0; i < n; i++)
+        if (!st[i].threaded && cg.on) {
+            leaf = cg_start();
+            break;
+        }
+    for (int i = 0; i < n; i++) {
+        if (st[i].threaded) continue;
+        if (!st[i].status) stage_fork(&st[i], fds, nfds, &leaf);
+        if (st[i].pid) last_pid = st[i].pid;
+        if (st[i].in >= 0) close(st[i].in);
+        if (st[i].out >= 0) close(st[i].out);
+    }
+    cg_started(&leaf);
+    for (int i = 0; i < n; i++) {
+        if (!st[i].threaded) continue;
+        bool piped_in = st[i].in >= 0 || st[i].ring_in;
+        st[i].io = (struct io){
+            .in = st[i].in >= 0 ? st[i].in : STDIN_FILENO,
+            .out = st[i].out >= 0 ? st[i].out : STDOUT_FILENO,
+            .ring_in = st[i].ring_in,
+            .ring_out = st[i].ring_out,
+            .inb = piped_in ? &st[i].inb : NULL,
+            .assign = &st[i].assign,
+        };
+        int err = pthread_create(&st[i].thread, NULL, stage_thread, &st[i]);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            st[i].threaded = false;
+            st[i].status = 1;
+            if (st[i].in >= 0) close(st[i].in);
+            if (st[i].out >= 0) close(st[i].out);
+            if (st[i].ring_in) ring_close(st[i].ring_in, true);
+            if (st[i].ring_out) ring_close(st[i].ring_out, false);
+        }
+    }
+
+    if (timed) {
+        fg_killed = 0;
+        fg_child = last_pid;
+        alarm(10);                  // same limit as a single command
+    }
+    for (int i = 0; i < n; i++) {
+        int status;
+        char cmd[REC_CMD_MAX];
+        if (rec.fd >= 0) rec_cmd(st[i].argv, cmd);
+        if (st[i].threaded) {
+            pthread_join(st[i].thread, NULL);
+            for (size_t k = 0; k < st[i].assign.len; ) {
+                const char *name = st[i].assign.p + k;
+                const char *value = name + strlen(name) + 1;
+                setenv(name, value, 1);
+                k = (size_t)(value + strlen(value) + 1 - st[i].assign.p);
+            }
+            free(st[i].assign.p);
+            last_status = st[i].status;
+            rec_add(cmd, 0, W_EXITCODE(last_status, 0), REC_BUILTIN, &start,
+                    &st[i].ru);
+        } else if (st[i].pid > 0) {
+            struct rusage ru;
+            if (wait4(st[i].pid, &status, 0, &ru) < 0) {
+                perror("waitpid");
+                continue;
+            }
+            set_child_status(status);
+            rec_add(cmd, st[i].pid, status,
+                    fg_killed && st[i].pid == last_pid ? REC_TIMED_OUT : 0,
+                    &start, &ru);
+        } else {
+            last_status = st[i].status;
+        }
+    }
+    if (timed) {
+        alarm(0);
+        fg_child = -1;
+    }
+    if (leaf.id) cg_finish(leaf.id, cg.last, sizeof(cg.last));
+    for (int i = 0; i < n; i++) free(st[i].ring_out);
+}
+
+/* run the pipeline starting at c; the number of commands it spans */
+static int run_pipeline(const struct command *c) {
+    int n = 1;
+
+    while (c[n - 1].pipe_next) n++;
+    if (n == 1) {
+        run_command(c);
+        return 1;
+    }
+    if (!run_if_met(c)) return n;
+    if (n > MAX_STAGES) {
+        fprintf(stderr, "pipeline too long\n");
+        last_status = 2;
+        return n;
+    }
+    if (!c[n - 1].background) {
+        pipeline_exec(c, n, true);
+        return n;
+    }
+
+    // in the background the whole pipeline is one job: a copy of the
+    // shell that runs it and exits with its status
+    fflush(stdout);
+    in_release();
+    struct cg_leaf leaf = cg_start();
+    pid_t pid = cg_fork(&leaf, false);
+    cg_started(&leaf);
+    if (pid < 0) {
+        perror("fork");
+        if (leaf.id) cg_finish(leaf.id, cg.last, sizeof(cg.last));
+        last_status = 1;
+        return n;
+    }
+    if (pid == 0) {
+        interactive = false;
+        if (limits_apply() < 0) _exit(1);
+        if (oom_set(0, oom_background) < 0) perror("oom_score_adj");
+        pipeline_exec(c, n, false);
+        rec_flush(true);
+        _exit(last_status);
+    }
+    int argc;
+    struct job *j = job_add(pid, expand_command(&c[0], &argc));
+    if (j) j->cg = leaf.id;
+    printf("[%d] started pid %d\n", j ? j->id : 0, pid);
+    last_status = 0;
+    return n;
+}
+
+/* lex, expand aliases, parse and run text in the current arena;
+ * PARSE_INCOMPLETE, without running anything, if it needs more input */
+static int run_text(const char *text) {
+    struct token *v;
+    struct command *cmds;
+
+    int n = lex(text, &v);
+    n = alias_splice(v, n, &v);
+    int nc = parse(v, n, &cmds);
+    if (nc == PARSE_INCOMPLETE) return nc;
+    if (nc < 0) {
+        last_status = 2;
+        rc.impure |= rc.active;
+        return nc;
+    }
+    for (int i = 0; i < nc; ) {
+        i += run_pipeline(&cmds[i]);
+        rc.impure |= rc.active && last_status != 0;
+    }
+    return 0;
+}
+
+/* run one line typed at the prompt, starting from a fresh arena */
+static int run_line(const char *line) {
+    retired_reap();
+    arena_reset();
+    stat_cache_clear();
+    return run_text(line);
+}
+
+/* ---- rc files ----
+ * `source` runs a file line by line, so aliases it defines apply to the
+ * lines after them. At startup an interactive shell runs ~/.shellrc,
+ * unless ~/.shellrc.snap says what it would do: the snapshot holds the
+ * variables, the alias values and the functions (already parsed) the rc
+ * file left behind. Alias values are lexed again as they are loaded. It
+ * is valid while every file it sourced, recorded by its real path, has
+ * the same mtime and size, or else the same content hash, and every
+ * inherited variable it read has the same value. Files that do more than
+ * define state, or source a path relative to the cwd, are never
+ * snapshotted. */
+
+#define SNAP_MAGIC     "shsnap3"
+#define MAX_SOURCE_DEPTH 32
+
+/* run the lines of text; a definition may span several */
+static void run_script(const char *text, size_t len, const char *name) {
+    struct strbuf acc = { 0 };
+    const char *p = text, *end = text + len;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        size_t n = nl ? (size_t)(nl - p) : (size_t)(end - p);
+
+        if (acc.len) sb_put(&acc, "\n", 1);
+        sb_put(&acc, p, n);
+        p += n + (nl != NULL);
+
+        struct arena_mark m = arena_save();
+        int r = run_text(acc.p);
+        arena_restore(m);
+        if (r != PARSE_INCOMPLETE) acc.len = 0;
+    }
+    if (acc.len)
+        fprintf(stderr, "%s: syntax error: unexpected end of file\n", name);
+    free(acc.p);
+}
+
+static int source_file(const char *path) {
+    static int depth;
+    struct stat st;
+
+    if (depth == MAX_SOURCE_DEPTH) {
+        fprintf(stderr, "source: %s: nested too deeply\n", path);
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        rc.impure |= rc.active;
+        fprintf(stderr, "source: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    char *text = malloc((size_t)st.st_size + 1);
+    ssize_t len = read(fd, text, (size_t)st.st_size);
+    close(fd);
+    if (len < 0) {
+        fprintf(stderr, "source: %s: %s\n", path, strerror(errno));
+        free(text);
+        return -1;
+    }
+    if (rc.active) {
+        // both the path and where it led: a symlink may be repointed.
+        // What a relative path names depends on the cwd, so that cannot
+        // be snapshotted
+        char abs[PATH_MAX * 2], cwd[PATH_MAX], real[PATH_MAX];
+        st.st_size = len;
+        if (path[0] != '/') rc.impure = true;
+        if (path[0] == '/' || !getcwd(cwd, sizeof(cwd)))
+            snprintf(abs, sizeof(abs), "%s", path);
+        else
+            snprintf(abs, sizeof(abs), "%s/%s", cwd, path);
+        rc_note_dep(abs, realpath(path, real) ? real : abs, &st,
+                    hash_bytes(text, (size_t)len));
+    }
+
+    depth++;
+    last_status = 0;
+    run_script(text, (size_t)len, path);
+    depth--;
+    free(text);
+    return 0;
+}
+
+static void snap_put_u32(struct strbuf *b, uint32_t v) { sb_put(b, (char *)&v, 4); }
+static void snap_put_u64(struct strbuf *b, uint64_t v) { sb_put(b, (char *)&v, 8); }
+
+/* length, bytes and a NUL, so a mapped string can be used in place */
+static void snap_put_str(struct strbuf *b, const char *s) {
+    snap_put_u32(b, (uint32_t)strlen(s));
+    sb_put(b, s, strlen(s) + 1);
+}
+
+static void snap_put_commands(struct strbuf *b, const struct command *c, int n) {
+    snap_put_u32(b, (uint32_t)n);
+    for (int i = 0; i < n; i++) {
+        snap_put_u32(b, (uint32_t)c[i].nwords);
+        for (int w = 0; w < c[i].nwords; w++) snap_put_str(b, c[i].words[w]);
+        snap_put_u32(b, (uint32_t)c[i].nredirs);
+        for (int k = 0; k < c[i].nredirs; k++) {
+            snap_put_u32(b, (uint32_t)c[i].redirs[k].fd);
+            snap_put_u32(b, c[i].redirs[k].kind);
+            snap_put_str(b, c[i].redirs[k].target);
+        }
+        snap_put_u32(b, c[i].run_if | (c[i].background ? 4u : 0) |
+                        (c[i].func_name ? 8u : 0) | (c[i].pipe_next ? 16u : 0));
+        if (c[i].func_name) snap_put_str(b, c[i].func_name);
+        snap_put_commands(b, c[i].body, c[i].nbody);
+    }
+}
+
+static void snap_save(const char *file) {
+    struct strbuf b = { 0 };
+    uint32_t n;
+
+    sb_put(&b, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+    snap_put_u32(&b, (uint32_t)rc.ndeps);
+    for (int i = 0; i < rc.ndeps; i++) {
+        const struct rc_dep *d = &rc.deps[i];
+        snap_put_str(&b, d->path);
+        snap_put_str(&b, d->real);
+        snap_put_u64(&b, (uint64_t)d->mtime_sec);
+        snap_put_u64(&b, (uint64_t)d->mtime_nsec);
+        snap_put_u64(&b, d->size);
+        snap_put_u32(&b, d->hash);
+    }
+
+    n = 0;
+    for (int i = 0; i < rc.nvars; i++) n += rc.vars[i].read;
+    snap_put_u32(&b, n);
+    for (int i = 0; i < rc.nvars; i++) {
+        if (!rc.vars[i].read) continue;
+        snap_put_str(&b, rc.vars[i].name);
+        snap_put_u32(&b, rc.vars[i].value != NULL);
+        snap_put_str(&b, rc.vars[i].value ? rc.vars[i].value : "");
+    }
+
+    n = 0;
+    for (int i = 0; i < rc.nvars; i++) n += rc.vars[i].set;
+    snap_put_u32(&b, n);
+    for (int i = 0; i < rc.nvars; i++) {
+        if (!rc.vars[i].set) continue;
+        const char *v = getenv(rc.vars[i].name);
+        snap_put_str(&b, rc.vars[i].name);
+        snap_put_str(&b, v ? v : "");
+    }
+
+    n = 0;
+    for (int k = 0; k < ALIAS_BUCKETS; k++)
+        for (struct alias *a = aliases[k]; a; a = a->next) n++;
+    snap_put_u32(&b, n);
+    for (int k = 0; k < ALIAS_BUCKETS; k++)
+        for (struct alias *a = aliases[k]; a; a = a->next) {
+            snap_put_str(&b, a->name);
+            snap_put_str(&b, a->value);
+        }
+
+    n = 0;
+    for (int k = 0; k < FUNC_BUCKETS; k++)
+        for (struct function *f = functions[k]; f; f = f->next) n++;
+    snap_put_u32(&b, n);
+    for (int k = 0; k < FUNC_BUCKETS; k++)
+        for (struct function *f = functions[k]; f; f = f->next) {
+            snap_put_str(&b, f->name);
+            snap_put_commands(&b, f->body, f->nbody);
+        }
+
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        write_all(fd, b.p, b.len);
+        close(fd);
+        if (rename(tmp, file) < 0) unlink(tmp);
+    }
+    free(b.p);
+}
+
+struct snap_reader {
+    const char *p, *end;
+    bool        bad;
+};
+
+static const void *snap_take(struct snap_reader *r, size_t n) {
+    if (r->bad || (size_t)(r->end - r->p) < n) {
+        r->bad = true;
+        return NULL;
+    }
+    r->p += n;
+    return r->p - n;
+}
+
+static uint32_t snap_u32(struct snap_reader *r) {
+    uint32_t v = 0;
+    const void *p = snap_take(r, 4);
+    if (p) memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t snap_u64(struct snap_reader *r) {
+    uint64_t v = 0;
+    const void *p = snap_take(r, 8);
+    if (p) memcpy(&v, p, 8);
+    return v;
+}
+
+static const char *snap_str(struct snap_reader *r) {
+    uint32_t len = snap_u32(r);
+    const char *s = snap_take(r, (size_t)len + 1);
+    if (s && s[len] != '\0') r->bad = true;
+    return r->bad ? "" : s;
+}
+
+/* commands into the arena, words pointing into the map */
+static int snap_commands(struct snap_reader *r, struct command **out) {
+    uint32_t n = snap_u32(r);
+
+    if (r->bad || n > (size_t)(r->end - r->p)) {
+        r->bad = true;
+        return 0;
+    }
+    struct command *c = arena_alloc(((size_t)n + 1) * sizeof(*c));
+    for (uint32_t i = 0; i < n && !r->bad; i++) {
+        memset(&c[i], 0, sizeof(c[i]));
+        uint32_t nwords = snap_u32(r);
+        if (nwords > (size_t)(r->end - r->p)) {
+            r->bad = true;
+            break;
+        }
+        c[i].nwords = (int)nwords;
+        c[i].words = arena_alloc(((size_t)nwords + 1) * sizeof(char *));
+        for (uint32_t w = 0; w < nwords; w++)
+            c[i].words[w] = (char *)snap_str(r);
+        c[i].words[nwords] = NULL;
+        uint32_t nredirs = snap_u32(r);
+        if (nredirs > (size_t)(r->end - r->p)) {
+            r->bad = true;
+            break;
+        }
+        c[i].nredirs = (int)nredirs;
+        c[i].redirs = arena_alloc(((size_t)nredirs + 1) * sizeof(struct redir));
+        for (uint32_t k = 0; k < nredirs; k++) {
+            c[i].redirs[k].fd = (int)snap_u32(r);
+            c[i].redirs[k].kind = (enum tok_kind)snap_u32(r);
+            c[i].redirs[k].target = snap_str(r);
+        }
+        uint32_t flags = snap_u32(r);
+        c[i].run_if = (enum run_if)(flags & 3);
+        c[i].background = flags & 4;
+        c[i].pipe_next = flags & 16;
+        if (flags & 8) c[i].func_name = snap_str(r);
+        c[i].nbody = snap_commands(r, &c[i].body);
     }
+    *out = c;
+    return (int)n;
+}
+
+/* does the file still have the content the snapshot was built from? */
+static bool snap_dep_valid(const char *path, const char *real, int64_t sec,
+                           int64_t nsec, uint64_t size, uint32_t hash) {
+    struct stat st;
+    char now[PATH_MAX];
+
+    // still leading to the same file
+    if (!realpath(path, now) || strcmp(now, real) != 0) return false;
+    path = real;
+    if (stat(path, &st) < 0 || (uint64_t)st.st_size != size) return false;
+    if (st.st_mtim.tv_sec == sec && st.st_mtim.tv_nsec == nsec) return true;
+
+    // touched but maybe unchanged: compare content
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    char *text = malloc(size + 1);
+    bool same = read(fd, text, size) == (ssize_t)size &&
+                hash_bytes(text, size) == hash;
+    free(text);
+    close(fd);
+    return same;
 }
 
-/* tokenize by whitespace, expand $VAR, return argc */
-static int tokenize(char *line, char **argv, int max_args, const char *delims) {
-    int argc = 0;
-    static char bufstore[MAX_COMMAND_LINE_ARGS][PATH_MAX];
+/* apply the snapshot if it is still valid */
+static bool snap_load(const char *file) {
+    struct stat st;
+    bool ok = false;
+
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    char *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    struct snap_reader r = { map, map + st.st_size, false };
+    const char *magic = snap_take(&r, sizeof(SNAP_MAGIC));
+    if (!magic || memcmp(magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0) goto out;
+
+    for (uint32_t i = 0, n = snap_u32(&r); i < n && !r.bad; i++) {
+        const char *path = snap_str(&r), *real = snap_str(&r);
+        int64_t sec = (int64_t)snap_u64(&r), nsec = (int64_t)snap_u64(&r);
+        uint64_t size = snap_u64(&r);
+        uint32_t hash = snap_u32(&r);
+        if (!r.bad && !snap_dep_valid(path, real, sec, nsec, size, hash)) goto out;
+    }
+    for (uint32_t i = 0, n = snap_u32(&r); i < n && !r.bad; i++) {
+        const char *name = snap_str(&r);
+        bool set = snap_u32(&r);
+        const char *value = snap_str(&r), *now = getenv(name);
+        if (!r.bad && (set != (now != NULL) || (now && strcmp(now, value) != 0)))
+            goto out;
+    }
+    if (r.bad) goto out;
 
-    for (char *tok = strtok(line, delims);
-         tok && argc < max_args - 1;
-         tok = strtok(NULL, delims)) {
+    // valid: everything after this point is state to apply, so decode it
+    // all before changing anything
+    struct snap_reader body = r;
+    uint32_t nenv = snap_u32(&r);
+    for (uint32_t i = 0; i < nenv; i++) snap_str(&r), snap_str(&r);
+    uint32_t nalias = snap_u32(&r);
+    for (uint32_t i = 0; i < nalias; i++) snap_str(&r), snap_str(&r);
+    uint32_t nfunc = snap_u32(&r);
+    if (r.bad || nfunc > (size_t)(r.end - r.p)) goto out;
+    struct command *defs = arena_alloc(((size_t)nfunc + 1) * sizeof(*defs));
+    for (uint32_t i = 0; i < nfunc && !r.bad; i++) {
+        memset(&defs[i], 0, sizeof(defs[i]));
+        defs[i].func_name = snap_str(&r);
+        defs[i].nbody = snap_commands(&r, &defs[i].body);
+    }
+    if (r.bad) goto out;
 
-        expand_env(bufstore[argc], sizeof(bufstore[argc]), tok);
-        argv[argc++] = bufstore[argc-1];
+    r = body;
+    for (uint32_t i = 0, n = snap_u32(&r); i < n; i++) {
+        const char *name = snap_str(&r);
+        setenv(name, snap_str(&r), 1);
+    }
+    for (uint32_t i = 0, n = snap_u32(&r); i < n; i++) {
+        const char *name = snap_str(&r);
+        alias_set(name, snap_str(&r));
     }
-    argv[argc] = NULL;
-    return argc;
+    for (uint32_t i = 0; i < nfunc; i++) function_define(&defs[i]);
+    ok = true;
+out:
+    munmap(map, (size_t)st.st_size);
+    arena_reset();
+    return ok;
 }
 
-/* prompt */
-static void print_prompt(void) {
-    char cwd[PATH_MAX];
-    if (getcwd(cwd, sizeof(cwd))) {
-        // format: <path/to/dir> >
-        printf("%s> ", cwd);
-    } else {
-        printf("> ");
+/* run ~/.shellrc, or apply its snapshot */
+static void rc_startup(void) {
+    const char *home = getenv("HOME");
+    char file[PATH_MAX], snap[PATH_MAX + 8];
+
+    if (!home) return;
+    snprintf(file, sizeof(file), "%s/.shellrc", home);
+    snprintf(snap, sizeof(snap), "%s.snap", file);
+    if (access(file, F_OK) < 0) return;
+    if (snap_load(snap)) return;
+
+    rc.active = true;
+    source_file(file);
+    rc.active = false;
+    if (rc.impure) unlink(snap);
+    else snap_save(snap);
+    rc_log_free();
+    retired_reap();
+    arena_reset();
+    last_status = 0;
+}
+
+/* ---- server ----
+ * `shell --serve SOCKET` is one long-lived shell answering many clients
+ * on a Unix socket. A client sends command lines ending in newlines and
+ * gets back, for each, frames of
+ *     1 LEN\nBYTES     stdout
+ *     2 LEN\nBYTES     stderr
+ *     x STATUS\n       done
+ * A connection's lines run in order; connections run side by side.
+ * A line made only of builtins that keep shell state (cd, setenv,
+ * alias, ...) runs in the server itself, so its effect carries over to
+ * every later request. Anything else runs in a forked copy of the
+ * server, whose stdout and stderr are pipes the epoll loop forwards. The
+ * server syncs the command cache before each fork, so a copy starts with
+ * the table built and variables set. Parsed lines are cached by text
+ * until an alias changes. */
+
+#define LINE_CACHE     256
+#define SERVE_EVENTS   256
+#define SERVE_BACKLOG  (1 << 20)    // unsent bytes before a child waits
+#define SERVE_LINE_MAX (64 * 1024)
+
+struct parsed_line {
+    char           *text;
+    unsigned        gen;            // alias_gen it was parsed under
+    int             nc;
+    struct command *cmds;
+};
+
+static struct parsed_line line_cache[LINE_CACHE];
+
+/* the parsed form of text from the cache, or parsed now and cached;
+ * NULL with *nc < 0 on a syntax error or PARSE_INCOMPLETE */
+static const struct command *line_parse(const char *text, int *nc) {
+    struct parsed_line *e = &line_cache[hash_bytes(text, strlen(text)) % LINE_CACHE];
+    struct token *v;
+    struct command *cmds;
+
+    if (e->text && e->gen == alias_gen && strcmp(e->text, text) == 0) {
+        *nc = e->nc;
+        return e->cmds;
     }
-    fflush(stdout);
+    int n = lex(text, &v);
+    n = alias_splice(v, n, &v);
+    *nc = parse(v, n, &cmds);
+    if (*nc < 0) return NULL;
+    free(e->text);
+    free(e->cmds);
+    e->text = strdup(text);
+    e->gen = alias_gen;
+    e->nc = *nc;
+    e->cmds = commands_dup(cmds, *nc);
+    return e->cmds;
 }
 
-static volatile sig_atomic_t fg_child = -1; // pid of foreground child or -1
+enum { EP_LISTEN, EP_CLIENT, EP_PIPE };
 
-static void sigint_ignore(int sig) {
-    (void)sig;
-    // ignore in the shell so Ctrl-C doesn’t kill the shell itself
-    write(STDOUT_FILENO, "\n", 1);
+struct conn;
+
+struct ep_ref {
+    int          kind;
+    struct conn *c;
+};
+
+struct conn {
+    int            fd;
+    struct ep_ref  ref, pipe_ref[2];
+    struct strbuf  in;              // received, not yet run
+    struct strbuf  pending;         // lines of a definition still open
+    struct strbuf  out;             // frames not yet sent
+    size_t         out_off;
+    uint32_t       events;          // what fd is watched for
+    pid_t          pid;             // request running in a child, or 0
+    int            pipes[2];        // its stdout and stderr, -1 at EOF
+    bool           paused;          // pipes unwatched: out is backed up
+    bool           closing;         // no more requests: drop when idle
+    bool           gone;            // the peer hung up; output is dropped
+    bool           quit;            // ran exit: the rest goes unrun
+    struct conn   *prev, *next;
+};
+
+static struct {
+    int           ep, listen;
+    int           cap[2];           // memfds standing in for fd 1 and 2
+    struct ep_ref listen_ref;
+    struct conn  *conns;
+    struct conn  *dead;             // dropped during this batch of events
+} srv = { .ep = -1, .listen = -1, .cap = { -1, -1 } };
+
+/* builtins a line may use to run in the server rather than a child */
+static bool serve_local_builtin(const char *name) {
+    static const char *names[] = {
+        "[", "alias", "cd", "cgroup", "dirs", "echo", "env", "hash", "job-oom",
+        "popd", "printf", "pushd", "pwd", "setenv", "test", "ulimit",
+        "unalias", "z", NULL
+    };
+    for (const char **n = names; *n; n++)
+        if (strcmp(*n, name) == 0) return !function_find(name);
+    return false;
 }
 
-static void sigalrm_kill_child(int sig) {
-    (void)sig;
-    if (fg_child > 0) {
-        kill(fg_child, SIGKILL);
+static bool serve_local(const struct command *c, int nc) {
+    for (int i = 0; i < nc; i++) {
+        if (c[i].func_name) continue;
+        if (c[i].pipe_next || c[i].background || !c[i].nwords ||
+            !serve_local_builtin(c[i].words[0]))
+            return false;
     }
+    return true;
 }
 
-static void install_parent_handlers(void) {
-    struct sigaction sa;
+static void serve_frame(struct conn *c, char kind, const char *p, size_t n) {
+    char head[32];
+    int len = kind == 'x'
+        ? snprintf(head, sizeof(head), "x %d\n", (int)n)
+        : snprintf(head, sizeof(head), "%c %zu\n", kind, n);
+    sb_put(&c->out, head, (size_t)len);
+    if (kind != 'x') sb_put(&c->out, p, n);
+}
 
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = sigint_ignore;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    sigaction(SIGINT, &sa, NULL);
+/* move what fd 1 and 2 wrote into the memfds into frames */
+static void serve_captured(struct conn *c) {
+    char buf[65536];
 
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = sigalrm_kill_child;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    sigaction(SIGALRM, &sa, NULL);
+    for (int k = 0; k < 2; k++) {
+        off_t end = lseek(srv.cap[k], 0, SEEK_CUR);
+        for (off_t at = 0; at < end; ) {
+            ssize_t r = pread(srv.cap[k], buf, sizeof(buf), at);
+            if (r <= 0) break;
+            serve_frame(c, k ? '2' : '1', buf, (size_t)r);
+            at += r;
+        }
+        if (ftruncate(srv.cap[k], 0) < 0) perror("ftruncate");
+        lseek(srv.cap[k], 0, SEEK_SET);
+    }
 }
 
-static void reset_child_signals(void) {
-    signal(SIGINT, SIG_DFL);
-    signal(SIGALRM, SIG_DFL);
+static void serve_watch(struct conn *c) {
+    struct epoll_event ev = { .data.ptr = &c->ref };
+    bool backed_up = c->out.len - c->out_off > SERVE_BACKLOG;
+
+    ev.events = (c->closing ? 0 : EPOLLIN | EPOLLRDHUP) |
+                (c->out_off < c->out.len ? EPOLLOUT : 0);
+    if (!c->gone && ev.events != c->events &&
+        epoll_ctl(srv.ep, EPOLL_CTL_MOD, c->fd, &ev) == 0)
+        c->events = ev.events;
+    if (backed_up == c->paused) return;
+    c->paused = backed_up;
+    for (int k = 0; k < 2; k++) {
+        if (c->pipes[k] < 0) continue;
+        struct epoll_event pe = { .events = backed_up ? 0 : EPOLLIN,
+                                  .data.ptr = &c->pipe_ref[k] };
+        epoll_ctl(srv.ep, EPOLL_CTL_MOD, c->pipes[k], &pe);
+    }
 }
 
-int main(void) {
-    // Stores the string typed into the command line.
-    char command_line[MAX_COMMAND_LINE_LEN];
-    char cmd_bak[MAX_COMMAND_LINE_LEN];
+/* the peer hung up: stop watching it, or its HUP would fire forever */
+static void serve_gone(struct conn *c) {
+    if (c->gone) return;
+    epoll_ctl(srv.ep, EPOLL_CTL_DEL, c->fd, NULL);
+    c->gone = c->closing = true;
+    c->in.len = 0;
+}
 
-    // Stores the tokenized command line input.
-    char *arguments[MAX_COMMAND_LINE_ARGS];
+static void serve_send(struct conn *c) {
+    if (c->gone) c->out_off = c->out.len;
+    while (c->out_off < c->out.len) {
+        ssize_t r = write(c->fd, c->out.p + c->out_off, c->out.len - c->out_off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && errno == EAGAIN) break;
+        if (r < 0) {                // the peer is gone: nobody to tell
+            serve_gone(c);
+            c->out_off = c->out.len;
+            break;
+        }
+        c->out_off += (size_t)r;
+    }
+    if (c->out_off == c->out.len) c->out_off = c->out.len = 0;
+}
 
-    install_parent_handlers();
+/* in a child: nothing of the server's may stay open */
+static void serve_close_all(void) {
+    close(srv.ep);
+    close(srv.listen);
+    close(srv.cap[0]);
+    close(srv.cap[1]);
+    for (struct conn *c = srv.conns; c; c = c->next) {
+        close(c->fd);
+        for (int k = 0; k < 2; k++)
+            if (c->pipes[k] >= 0) close(c->pipes[k]);
+    }
+}
 
-    while (true) {
-        do {
-            // Print the shell prompt with current working directory.
-            print_prompt();   // already does printf + fflush(stdout)
+static void serve_fork(struct conn *c, const struct command *cmds, int nc) {
+    int o[2], e[2];
 
-            // Read input from stdin and store it in command_line...
-            if ((fgets(command_line, MAX_COMMAND_LINE_LEN, stdin) == NULL) &&
-                ferror(stdin)) {
-                fprintf(stderr, "fgets error");
-                exit(0);
-            }
-        } while (command_line[0] == 0x0A);  // while just ENTER pressed
+    if (pipe2(o, O_CLOEXEC) < 0) goto fail;
+    if (pipe2(e, O_CLOEXEC) < 0) {
+        close(o[0]);
+        close(o[1]);
+        goto fail;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        for (int k = 0; k < 2; k++) {
+            close(o[k]);
+            close(e[k]);
+        }
+        goto fail;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDONLY);
+        dup2(null, STDIN_FILENO);
+        dup2(o[1], STDOUT_FILENO);
+        dup2(e[1], STDERR_FILENO);
+        serve_close_all();
+        in.pos = in.len = 0;
+        signal(SIGPIPE, SIG_DFL);   // a client that left ends the request
+        for (int i = 0; i < nc; )
+            i += run_pipeline(&cmds[i]);
+        out_flush();
+        fflush(stdout);
+        rec_flush(true);
+        _exit(last_status);
+    }
+    close(o[1]);
+    close(e[1]);
+    c->pid = pid;
+    c->pipes[0] = o[0];
+    c->pipes[1] = e[0];
+    c->paused = false;
+    for (int k = 0; k < 2; k++) {
+        fcntl(c->pipes[k], F_SETFL, O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &c->pipe_ref[k] };
+        epoll_ctl(srv.ep, EPOLL_CTL_ADD, c->pipes[k], &ev);
+    }
+    return;
 
-        command_line[strlen(command_line) - 1] = '\0';
+fail:
+    perror("serve");
+    serve_frame(c, 'x', NULL, 1);
+}
 
-        // If the user input was EOF (ctrl+d), exit the shell.
-        if (feof(stdin)) {
-            printf("\n");
-            fflush(stdout);
-            fflush(stderr);
-            return 0;
+/* one complete line from c */
+static void serve_request(struct conn *c, const char *line) {
+    if (c->pending.len) sb_put(&c->pending, "\n", 1);
+    sb_put(&c->pending, line, strlen(line));
+
+    retired_reap();
+    arena_reset();
+    stat_cache_clear();
+
+    // parse and, for builtins, run with fd 1 and 2 in the memfds
+    fflush(stdout);
+    fflush(stderr);
+    int save1 = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    int save2 = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+    dup2(srv.cap[0], STDOUT_FILENO);
+    dup2(srv.cap[1], STDERR_FILENO);
+
+    int nc;
+    const struct command *cmds = line_parse(c->pending.p, &nc);
+    bool local = nc < 0 || serve_local(cmds, nc);
+    if (nc == PARSE_INCOMPLETE) {
+        local = false;
+    } else if (nc < 0) {
+        last_status = 2;
+    } else if (local) {
+        for (int i = 0; i < nc; )
+            i += run_pipeline(&cmds[i]);
+        out_flush();
+    }
+    fflush(stdout);
+    fflush(stderr);
+    dup2(save1, STDOUT_FILENO);
+    dup2(save2, STDERR_FILENO);
+    close(save1);
+    close(save2);
+    serve_captured(c);
+
+    if (nc == PARSE_INCOMPLETE) return;     // wait for the rest
+    c->pending.len = 0;
+    if (nc == 1 && cmds[0].nwords && strcmp(cmds[0].words[0], "exit") == 0)
+        c->closing = c->quit = true;    // a child runs it, for the status
+    if (local) {
+        serve_frame(c, 'x', NULL, (size_t)last_status);
+    } else {
+        path_cache_sync();          // so the copy inherits a built table
+        serve_fork(c, cmds, nc);
+    }
+}
+
+/* freed once the batch of events is through, which may still name it */
+static void serve_drop(struct conn *c) {
+    if (!c->gone) epoll_ctl(srv.ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    if (c->prev) c->prev->next = c->next;
+    else srv.conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    free(c->in.p);
+    free(c->pending.p);
+    free(c->out.p);
+    c->next = srv.dead;
+    srv.dead = c;
+}
+
+/* run queued lines until one goes to a child; false if c was dropped */
+static bool serve_progress(struct conn *c) {
+    while (!c->pid) {
+        char *nl = c->in.len ? memchr(c->in.p, '\n', c->in.len) : NULL;
+        if (!nl) break;
+        *nl = '\0';
+        if (nl > c->in.p && nl[-1] == '\r') nl[-1] = '\0';
+        serve_request(c, c->in.p);
+        size_t used = (size_t)(nl + 1 - c->in.p);
+        memmove(c->in.p, nl + 1, c->in.len - used);
+        c->in.len -= used;
+        if (c->quit) c->in.len = 0;
+    }
+    serve_send(c);
+    if (c->closing && !c->pid && c->out_off == c->out.len) {
+        serve_drop(c);
+        return false;
+    }
+    serve_watch(c);
+    return true;
+}
+
+static void serve_accept(void) {
+    for (;;) {
+        int fd = accept4(srv.listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EINTR) perror("accept");
+            return;
+        }
+        struct conn *c = calloc(1, sizeof(*c));
+        c->fd = fd;
+        c->ref = (struct ep_ref){ EP_CLIENT, c };
+        c->pipe_ref[0] = c->pipe_ref[1] = (struct ep_ref){ EP_PIPE, c };
+        c->pipes[0] = c->pipes[1] = -1;
+        c->events = EPOLLIN | EPOLLRDHUP;
+        struct epoll_event ev = { .events = c->events, .data.ptr = &c->ref };
+        if (epoll_ctl(srv.ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(fd);
+            free(c);
+            continue;
         }
+        c->next = srv.conns;
+        if (srv.conns) srv.conns->prev = c;
+        srv.conns = c;
+    }
+}
 
-        // 1. Tokenize the command line input (split it on whitespace)
-        int argc = tokenize(command_line, arguments,
-                            MAX_COMMAND_LINE_ARGS, delimiters);
-        if (argc == 0) continue; // empty
-
-        // ===== Extra Credit: simple output redirection ">" =====
-        int redirect_out = 0;
-        char *out_file = NULL;
-        for (int i = 0; i < argc; i++) {
-            if (strcmp(arguments[i], ">") == 0) {
-                if (i + 1 >= argc) {
-                    fprintf(stderr,
-                            "usage: command ... > filename\n");
-                    argc = 0;
-                    break;
-                }
-                redirect_out = 1;
-                out_file = arguments[i + 1];
-                arguments[i] = NULL; // end of argv for execvp
-                argc = i;            // logical argc
+static void serve_client(struct conn *c, uint32_t events) {
+    char buf[65536];
+
+    if (events & EPOLLIN) {
+        for (;;) {
+            ssize_t r = read(c->fd, buf, sizeof(buf));
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0 && errno == EAGAIN) break;
+            if (r <= 0) {           // EOF: the client said all it will
+                if (r < 0) serve_gone(c);
+                c->closing = true;
+                break;
+            }
+            sb_put(&c->in, buf, (size_t)r);
+            if (c->in.len > SERVE_LINE_MAX && !memchr(c->in.p, '\n', c->in.len)) {
+                serve_frame(c, '2', "line too long\n", 14);
+                serve_frame(c, 'x', NULL, 2);
+                c->in.len = 0;
+                c->closing = true;
                 break;
             }
         }
-        if (argc == 0) continue;
+    }
+    // a client that shuts down its side after writing still gets its
+    // queued lines answered
+    if (!c->gone && events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        c->closing = true;
+        if (events & (EPOLLHUP | EPOLLERR)) serve_gone(c);
+    }
+    serve_progress(c);
+}
 
-        // 2. Implement Built-In Commands
-        if (strcmp(arguments[0], "exit") == 0) {
-            puts("");
-            fflush(stdout);
-            fflush(stderr);
-            break;
-        }
+/* output of c's request; at EOF on both, its status */
+static void serve_pipe(struct conn *c, struct ep_ref *ref) {
+    int k = ref == &c->pipe_ref[1];
+    char buf[65536];
 
-        if (strcmp(arguments[0], "pwd") == 0) {
-            char cwd[PATH_MAX];
-            if (getcwd(cwd, sizeof(cwd)))
-                puts(cwd);
-            else
-                perror("pwd");
+    for (;;) {
+        ssize_t r = read(c->pipes[k], buf, sizeof(buf));
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && errno == EAGAIN) break;
+        if (r > 0) {
+            serve_frame(c, k ? '2' : '1', buf, (size_t)r);
+            if (c->out.len - c->out_off > SERVE_BACKLOG) break;
             continue;
         }
+        epoll_ctl(srv.ep, EPOLL_CTL_DEL, c->pipes[k], NULL);
+        close(c->pipes[k]);
+        c->pipes[k] = -1;
+        break;
+    }
+    if (c->pipes[0] < 0 && c->pipes[1] < 0) {
+        // both closed: the child is exiting, if it has not already
+        int status;
+        if (waitpid(c->pid, &status, 0) < 0) status = 1 << 8;
+        c->pid = 0;
+        serve_frame(c, 'x', NULL, (size_t)(WIFSIGNALED(status)
+                                           ? 128 + WTERMSIG(status)
+                                           : WEXITSTATUS(status)));
+    }
+    serve_progress(c);
+}
 
-        if (strcmp(arguments[0], "cd") == 0) {
-            const char *target = (argc > 1) ? arguments[1] : getenv("HOME");
-            if (!target) target = ".";
-            if (chdir(target) != 0) perror("cd");
-            continue;
+static int serve(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "serve: %s: path too long\n", path);
+        return 2;
+    }
+    strcpy(addr.sun_path, path);
+    // a socket left by an earlier server is replaced, anything else kept
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+    signal(SIGINT, SIG_DFL);
+    srv.listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (srv.listen < 0 || bind(srv.listen, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(srv.listen, SOMAXCONN) < 0) {
+        perror(path);
+        return 1;
+    }
+    srv.ep = epoll_create1(EPOLL_CLOEXEC);
+    srv.cap[0] = memfd_create("serve-stdout", MFD_CLOEXEC);
+    srv.cap[1] = memfd_create("serve-stderr", MFD_CLOEXEC);
+    if (srv.ep < 0 || srv.cap[0] < 0 || srv.cap[1] < 0) {
+        perror("serve");
+        return 1;
+    }
+    path_cache_sync();
+    srv.listen_ref.kind = EP_LISTEN;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &srv.listen_ref };
+    epoll_ctl(srv.ep, EPOLL_CTL_ADD, srv.listen, &ev);
+
+    struct epoll_event events[SERVE_EVENTS];
+    for (;;) {
+        int n = epoll_wait(srv.ep, events, SERVE_EVENTS, -1);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            struct ep_ref *ref = events[i].data.ptr;
+            if (ref->kind == EP_LISTEN) serve_accept();
+            else if (ref->c->fd < 0) continue;
+            else if (ref->kind == EP_CLIENT) serve_client(ref->c, events[i].events);
+            else serve_pipe(ref->c, ref);
         }
+        while (srv.dead) {
+            struct conn *c = srv.dead;
+            srv.dead = c->next;
+            free(c);
+        }
+        rec_flush(false);
+    }
+}
+
+/* ---- batch ----
+ * `shell --jsonl [LIMIT]` reads one JSON request per line of stdin,
+ *     {"id": ..., "argv": [...] | "line": "...", "env": {...},
+ *      "cwd": "...", "timeout": SECONDS, "stdin": "..."}
+ * runs up to LIMIT of them at once, and writes one JSON result per
+ * finished request to stdout, in completion order. "argv" is exec'd as
+ * is; "line" is run by the shell. The id is echoed back verbatim. */
+
+#define BATCH_OUT_MAX (8 << 20)     // captured per stream; the rest dropped
+
+struct batch_req {
+    char  *id;                      // JSON text, or NULL
+    char **argv;
+    char  *line;
+    char **env;                     // NAME=VALUE
+    char  *cwd;
+    double timeout;                 // seconds, 0 = none
+    char  *in;
+    size_t inlen;
+};
+
+struct batch_job {
+    struct batch_req r;
+    pid_t            pid;           // 0 = free slot
+    int              pidfd;         // readable once it exits; -1 if none
+    bool             reaped;
+    int              status;
+    struct rusage    ru;
+    int              fd[3];         // child's stdout, stderr; its stdin
+    size_t           in_off;
+    struct strbuf    cap[2];
+    bool             truncated[2];
+    bool             timed_out;
+    struct timespec  start;
+};
+
+static struct batch_job *batch;
+static int               batch_limit, batch_running;
 
-        if (strcmp(arguments[0], "echo") == 0) {
-            for (int i = 1; i < argc; i++) {
-                if (i > 1) putchar(' ');
-                fputs(arguments[i], stdout);
+/* ---- a JSON reader for the request fields ---- */
+
+static const char *json_ws(const char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+    return p;
+}
+
+static void json_utf8(struct strbuf *b, unsigned cp) {
+    char u[4];
+    size_t n;
+
+    if (cp < 0x80) { u[0] = (char)cp; n = 1; }
+    else if (cp < 0x800) { u[0] = (char)(0xc0 | cp >> 6); n = 2; }
+    else if (cp < 0x10000) { u[0] = (char)(0xe0 | cp >> 12); n = 3; }
+    else { u[0] = (char)(0xf0 | cp >> 18); n = 4; }
+    for (size_t i = 1; i < n; i++)
+        u[i] = (char)(0x80 | (cp >> (6 * (n - 1 - i)) & 0x3f));
+    sb_put(b, u, n);
+}
+
+static const char *json_hex4(const char *p, unsigned *v) {
+    *v = 0;
+    for (int i = 0; i < 4; i++, p++) {
+        unsigned d = *p >= '0' && *p <= '9' ? (unsigned)(*p - '0')
+                   : (*p | 0x20) >= 'a' && (*p | 0x20) <= 'f' ? (unsigned)((*p | 0x20) - 'a' + 10)
+                   : 16;
+        if (d == 16) return NULL;
+        *v = *v << 4 | d;
+    }
+    return p;
+}
+
+/* a string at p, unescaped into b; just past it, or NULL */
+static const char *json_string(const char *p, struct strbuf *b) {
+    if (*p++ != '"') return NULL;
+    b->len = 0;
+    sb_put(b, "", 0);
+    for (;;) {
+        const char *q = p;
+        while (*q && *q != '"' && *q != '\\' && (unsigned char)*q >= 0x20) q++;
+        sb_put(b, p, (size_t)(q - p));
+        p = q;
+        if (*p == '"') return p + 1;
+        if (*p != '\\') return NULL;
+        char e = p[1];
+        p += 2;
+        const char *map = strchr("\"\"\\\\//b\bf\fn\nr\rt\t", e);
+        if (e && map && (map - "\"\"\\\\//b\bf\fn\nr\rt\t") % 2 == 0) {
+            sb_put(b, map + 1, 1);
+        } else if (e == 'u') {
+            unsigned cp, lo;
+            if (!(p = json_hex4(p, &cp))) return NULL;
+            if (cp >= 0xd800 && cp < 0xdc00 && p[0] == '\\' && p[1] == 'u' &&
+                json_hex4(p + 2, &lo) && lo >= 0xdc00 && lo < 0xe000) {
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                p += 6;
             }
-            putchar('\n');
-            continue;
+            json_utf8(b, cp);
+        } else {
+            return NULL;
         }
+    }
+}
 
-        if (strcmp(arguments[0], "env") == 0) {
-            if (argc == 1) {
-                for (char **e = environ; *e; ++e) puts(*e);
-            } else {
-                for (int i = 1; i < argc; ++i) {
-                    const char *v = getenv(arguments[i]);
-                    if (v) puts(v);
-                }
+/* past any value at p, or NULL */
+static const char *json_skip(const char *p) {
+    struct strbuf tmp = { 0 };
+
+    p = json_ws(p);
+    if (*p == '"') {
+        p = json_string(p, &tmp);
+    } else if (*p == '{' || *p == '[') {
+        char close = *p == '{' ? '}' : ']';
+        p = json_ws(p + 1);
+        while (p && *p != close) {
+            if (close == '}') {
+                p = json_string(p, &tmp);
+                if (!p || *(p = json_ws(p)) != ':') p = NULL;
+                else p++;
             }
-            continue;
+            if (p && (p = json_skip(p))) p = json_ws(p);
+            if (p && *p == ',') p = json_ws(p + 1);
+            else if (p && *p != close) p = NULL;
         }
+        if (p) p++;
+    } else if (strchr("-0123456789tfn", *p) && *p) {
+        while (*p && strchr("+-.0123456789eEtruefalsn", *p)) p++;
+    } else {
+        p = NULL;
+    }
+    free(tmp.p);
+    return p;
+}
 
-        if (strcmp(arguments[0], "setenv") == 0) {
-            if (argc < 2) {
-                fprintf(stderr, "usage: setenv NAME=VALUE\n");
-                continue;
-            }
-            char *eq = strchr(arguments[1], '=');
-            if (!eq) {
-                fprintf(stderr, "usage: setenv NAME=VALUE\n");
-                continue;
+/* ["...", ...] or {"K": "V", ...} into a NULL-ended vector; NAME=VALUE
+ * for an object */
+static const char *json_strings(const char *p, char ***out) {
+    struct strbuf s = { 0 }, k = { 0 };
+    size_t n = 0;
+    bool obj = *p == '{';
+    char close = obj ? '}' : ']';
+
+    *out = calloc(1, sizeof(char *));
+    p = json_ws(p + 1);
+    while (p && *p != close) {
+        if (obj) {
+            p = json_string(p, &k);
+            if (!p || *(p = json_ws(p)) != ':') break;
+            p = json_ws(p + 1);
+        }
+        if (!(p = json_string(p, &s))) break;
+        *out = realloc(*out, (n + 2) * sizeof(char *));
+        if (obj) {
+            (*out)[n] = malloc(k.len + s.len + 2);
+            sprintf((*out)[n], "%s=%s", k.p, s.p);
+        } else {
+            (*out)[n] = strdup(s.p);
+        }
+        (*out)[++n] = NULL;
+        p = json_ws(p);
+        if (*p == ',') p = json_ws(p + 1);
+        else if (*p != close) p = NULL;
+    }
+    free(s.p);
+    free(k.p);
+    return p && *p == close ? p + 1 : NULL;
+}
+
+static void batch_free_vec(char **v) {
+    for (char **p = v; p && *p; p++) free(*p);
+    free(v);
+}
+
+static void batch_req_free(struct batch_req *r) {
+    free(r->id);
+    batch_free_vec(r->argv);
+    free(r->line);
+    batch_free_vec(r->env);
+    free(r->cwd);
+    free(r->in);
+    memset(r, 0, sizeof(*r));
+}
+
+/* a request line into r; NULL, or what is wrong with it */
+static const char *batch_parse(const char *p, struct batch_req *r) {
+    struct strbuf key = { 0 }, val = { 0 };
+    const char *err = NULL;
+
+    p = json_ws(p);
+    if (*p++ != '{') return "not a JSON object";
+    p = json_ws(p);
+    while (*p != '}') {
+        if (!(p = json_string(p, &key)) || *(p = json_ws(p)) != ':') {
+            err = "bad JSON";
+            break;
+        }
+        p = json_ws(p + 1);
+        const char *v = p;
+        if (strcmp(key.p, "id") == 0) {
+            if ((p = json_skip(p))) r->id = strndup(v, (size_t)(p - v));
+        } else if (strcmp(key.p, "argv") == 0 && *p == '[') {
+            batch_free_vec(r->argv);
+            p = json_strings(p, &r->argv);
+        } else if (strcmp(key.p, "env") == 0 && *p == '{') {
+            batch_free_vec(r->env);
+            p = json_strings(p, &r->env);
+        } else if (strcmp(key.p, "timeout") == 0 && (*p == '-' || (*p >= '0' && *p <= '9'))) {
+            char *end;
+            r->timeout = strtod(p, &end);
+            p = end;
+        } else if (*p == '"' && (strcmp(key.p, "line") == 0 ||
+                                 strcmp(key.p, "cwd") == 0 ||
+                                 strcmp(key.p, "stdin") == 0)) {
+            if ((p = json_string(p, &val))) {
+                char **dst = key.p[0] == 'l' ? &r->line : key.p[0] == 'c' ? &r->cwd : &r->in;
+                free(*dst);
+                *dst = malloc(val.len + 1);
+                memcpy(*dst, val.p, val.len + 1);
+                if (dst == &r->in) r->inlen = val.len;
             }
-            *eq = '\0';
-            const char *name = arguments[1];
-            const char *val  = eq + 1;
-            if (setenv(name, val, 1) != 0)
-                perror("setenv");
-            continue;
+        } else {
+            p = json_skip(p);       // unknown keys are ignored
         }
+        if (!p) {
+            err = "bad JSON";
+            break;
+        }
+        p = json_ws(p);
+        if (*p == ',') p = json_ws(p + 1);
+        else if (*p != '}') {
+            err = "bad JSON";
+            break;
+        }
+    }
+    free(key.p);
+    free(val.p);
+    if (!err && !r->line && (!r->argv || !r->argv[0]))
+        err = "need \"argv\" or \"line\"";
+    return err;
+}
+
+/* ---- running and reporting ---- */
+
+static void batch_report(const char *id, int status, const struct rusage *ru,
+                         const struct batch_job *j, const char *error) {
+    struct strbuf b = { 0 };
+    struct timespec now;
+    char num[512];
 
-        // 3. Background job handling: look for '&' at end
-        int background = 0;
-        if (argc > 0 && strcmp(arguments[argc - 1], "&") == 0) {
-            background = 1;
-            arguments[argc - 1] = NULL;
-            argc--;
-            if (argc == 0) continue; // only '&'
+    sb_put(&b, "{\"id\":", 6);
+    sb_put(&b, id ? id : "null", strlen(id ? id : "null"));
+    if (error) {
+        sb_put(&b, ",\"error\":", 9);
+        json_put_string(&b, error, strlen(error));
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        bool sig = WIFSIGNALED(status);
+        int n = snprintf(num, sizeof(num),
+            ",\"status\":%d,\"signal\":%d,\"timed_out\":%s,\"duration_ms\":%.3f,"
+            "\"rusage\":{\"utime_ms\":%.3f,\"stime_ms\":%.3f,\"maxrss_kb\":%ld,"
+            "\"minflt\":%ld,\"majflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}",
+            sig ? 128 + WTERMSIG(status) : WEXITSTATUS(status),
+            sig ? WTERMSIG(status) : 0, j->timed_out ? "true" : "false",
+            ms_between(&j->start, &now),
+            ru->ru_utime.tv_sec * 1e3 + ru->ru_utime.tv_usec / 1e3,
+            ru->ru_stime.tv_sec * 1e3 + ru->ru_stime.tv_usec / 1e3,
+            ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt, ru->ru_nvcsw, ru->ru_nivcsw);
+        sb_put(&b, num, (size_t)n);
+        for (int k = 0; k < 2; k++) {
+            sb_put(&b, k ? ",\"stderr\":" : ",\"stdout\":", 10);
+            json_put_string(&b, j->cap[k].p ? j->cap[k].p : "", j->cap[k].len);
+            if (j->truncated[k])
+                sb_put(&b, k ? ",\"stderr_truncated\":true" : ",\"stdout_truncated\":true", 24);
         }
+    }
+    sb_put(&b, "}\n", 2);
+    write_all(STDOUT_FILENO, b.p, b.len);
+    free(b.p);
+}
+
+/* in a child: nothing of the other jobs may stay open */
+static void batch_close_others(void) {
+    for (int i = 0; i < batch_limit; i++)
+        for (int k = 0; k < 3; k++)
+            if (batch[i].pid && batch[i].fd[k] >= 0) close(batch[i].fd[k]);
+}
+
+static void batch_start(struct batch_job *j) {
+    int p[3][2] = { { -1, -1 }, { -1, -1 }, { -1, -1 } };
+    char exe_buf[PATH_MAX];
+    const char *exe = j->r.argv ? cmd_lookup(j->r.argv[0], exe_buf, sizeof(exe_buf)) : NULL;
 
-        // 4. The parent process should wait for the child to complete
-        //    unless it's a background process
-        pid_t pid = fork();
-        if (pid < 0) {
-            perror("fork");
+    for (int k = 0; k < (j->r.in ? 3 : 2); k++)
+        if (pipe2(p[k], O_CLOEXEC) < 0) goto fail;
+    clock_gettime(CLOCK_MONOTONIC, &j->start);
+    pid_t pid = fork();
+    if (pid < 0) goto fail;
+    if (pid == 0) {
+        setpgid(0, 0);              // a timeout takes what it started too
+        reset_child_signals();
+        batch_close_others();
+        int fd0 = j->r.in ? p[2][0] : open("/dev/null", O_RDONLY);
+        dup2(fd0, STDIN_FILENO);
+        dup2(p[0][1], STDOUT_FILENO);
+        dup2(p[1][1], STDERR_FILENO);
+        // a "line" never execs, so O_CLOEXEC would leave our copy of the
+        // stdin pipe's write end open and its reads would never see EOF
+        for (int k = 0; k < 3; k++)
+            for (int e = 0; e < 2; e++)
+                if (p[k][e] > STDERR_FILENO) close(p[k][e]);
+        if (!j->r.in && fd0 > STDERR_FILENO) close(fd0);
+        for (char **e = j->r.env; e && *e; e++) putenv(*e);
+        if (j->r.cwd && chdir(j->r.cwd) < 0) {
+            perror(j->r.cwd);
+            _exit(126);
+        }
+        if (limits_apply() < 0) _exit(1);
+        if (j->r.argv) {
+            if (j->r.env) exe = NULL;   // PATH may be another
+            exec_child(j->r.argv, exe);
+        }
+        in.pos = in.len = 0;
+        signal(SIGPIPE, SIG_IGN);
+        run_line(j->r.line);
+        out_flush();
+        fflush(stdout);
+        rec_flush(true);
+        _exit(last_status);
+    }
+    // on both sides, so a timeout that fires before the child has run
+    // still finds the group; EACCES once it has exec'd is fine
+    setpgid(pid, pid);
+    j->pid = pid;
+    j->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    for (int k = 0; k < 3; k++) {
+        if (p[k][0] < 0) {
+            j->fd[k] = -1;
             continue;
         }
+        j->fd[k] = k == 2 ? p[k][1] : p[k][0];
+        close(k == 2 ? p[k][0] : p[k][1]);
+        fcntl(j->fd[k], F_SETFL, O_NONBLOCK);
+    }
+    batch_running++;
+    return;
 
-        if (pid == 0) {
-            // ---- child ----
-            reset_child_signals();
+fail:
+    for (int k = 0; k < 3; k++)
+        for (int e = 0; e < 2; e++)
+            if (p[k][e] >= 0) close(p[k][e]);
+    batch_report(j->r.id, 0, NULL, j, strerror(errno));
+    batch_req_free(&j->r);
+}
 
-            // apply output redirection if requested
-            if (redirect_out) {
-                int fd = open(out_file,
-                              O_WRONLY | O_CREAT | O_TRUNC,
-                              0666);
-                if (fd < 0) {
-                    perror("open");
-                    _exit(127);
-                }
-                if (dup2(fd, STDOUT_FILENO) < 0) {
-                    perror("dup2");
-                    close(fd);
-                    _exit(127);
+static void batch_read(struct batch_job *j, int k) {
+    char buf[65536];
+
+    for (;;) {
+        ssize_t r = read(j->fd[k], buf, sizeof(buf));
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && errno == EAGAIN) return;
+        if (r <= 0) break;
+        size_t room = BATCH_OUT_MAX - j->cap[k].len, take = (size_t)r;
+        if (take > room) {
+            take = room;
+            j->truncated[k] = true;
+        }
+        sb_put(&j->cap[k], buf, take);
+    }
+    close(j->fd[k]);
+    j->fd[k] = -1;
+}
+
+static void batch_feed(struct batch_job *j) {
+    while (j->in_off < j->r.inlen) {
+        ssize_t w = write(j->fd[2], j->r.in + j->in_off, j->r.inlen - j->in_off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && errno == EAGAIN) return;
+        if (w < 0) break;           // it stopped reading: fine
+        j->in_off += (size_t)w;
+    }
+    close(j->fd[2]);
+    j->fd[2] = -1;
+}
+
+/* both outputs at EOF: collect and report */
+/* collect the job's status if it has exited; never blocks, since its
+ * output can reach EOF long before it does */
+static void batch_reap(struct batch_job *j) {
+    pid_t r = wait4(j->pid, &j->status, WNOHANG, &j->ru);
+    if (r == 0 || (r < 0 && errno == EINTR)) return;
+    if (r < 0) {
+        memset(&j->ru, 0, sizeof(j->ru));
+        j->status = 1 << 8;
+    }
+    j->reaped = true;
+    if (j->pidfd >= 0) close(j->pidfd);
+    j->pidfd = -1;
+}
+
+/* report the job once its output is drained and it has been reaped */
+static void batch_finish(struct batch_job *j) {
+    if (j->fd[0] >= 0 || j->fd[1] >= 0 || !j->reaped) return;
+    if (j->fd[2] >= 0) close(j->fd[2]);
+    batch_report(j->r.id, j->status, &j->ru, j, NULL);
+    batch_req_free(&j->r);
+    for (int k = 0; k < 2; k++) {
+        free(j->cap[k].p);
+        j->cap[k] = (struct strbuf){ 0 };
+        j->truncated[k] = false;
+    }
+    j->pid = 0;
+    j->reaped = false;
+    j->in_off = 0;
+    j->timed_out = false;
+    batch_running--;
+}
+
+/* start the next request in lines, if a slot is free; false if none */
+static bool batch_next(struct strbuf *lines) {
+    char *nl;
+
+    while (batch_running < batch_limit && (nl = memchr(lines->p, '\n', lines->len))) {
+        *nl = '\0';
+        struct batch_job *j = batch;
+        while (j->pid) j++;
+        const char *err = *json_ws(lines->p) ? batch_parse(lines->p, &j->r) : "";
+        size_t used = (size_t)(nl + 1 - lines->p);
+        memmove(lines->p, nl + 1, lines->len - used);
+        lines->len -= used;
+        if (err && *err) batch_report(j->r.id, 0, NULL, j, err);
+        if (err) batch_req_free(&j->r);
+        else batch_start(j);
+    }
+    return batch_running < batch_limit;
+}
+
+/* --jsonl's LIMIT: a whole number of at least 1 */
+static bool batch_parse_limit(const char *s, int *limit) {
+    char *end;
+    errno = 0;
+    long n = strtol(s, &end, 10);
+    if (end == s || *end || errno || n < 1 || n > INT_MAX) return false;
+    *limit = (int)n;
+    return true;
+}
+
+static int batch_run(int limit) {
+    struct strbuf lines = { 0 };
+    struct pollfd *pfd;
+    struct batch_job **owner;       // whose fd each pfd is
+    bool eof = false;
+
+    batch_limit = limit > 0 ? limit : 1;
+    batch = calloc((size_t)batch_limit, sizeof(*batch));
+    pfd = calloc((size_t)batch_limit * 4 + 1, sizeof(*pfd));
+    owner = calloc((size_t)batch_limit * 4, sizeof(*owner));
+    sb_put(&lines, "", 0);
+    signal(SIGINT, SIG_DFL);
+
+    while (!eof || batch_running || memchr(lines.p, '\n', lines.len)) {
+        bool room = batch_next(&lines);
+        if (eof && !batch_running) {
+            if (!lines.len) break;
+            sb_put(&lines, "\n", 1);     // a last line without a newline
+            continue;
+        }
+
+        // the nearest deadline bounds the wait
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int wait_ms = -1, n = 0;
+        for (int i = 0; i < batch_limit; i++) {
+            struct batch_job *j = &batch[i];
+            if (!j->pid) continue;
+            if (j->r.timeout > 0 && !j->timed_out) {
+                double left = j->r.timeout * 1e3 - ms_between(&j->start, &now);
+                if (left <= 0) {
+                    kill(-j->pid, SIGKILL);
+                    j->timed_out = true;
+                } else if (wait_ms < 0 || left + 1 < wait_ms) {
+                    wait_ms = (int)left + 1;
                 }
-                close(fd);
             }
+            for (int k = 0; k < 3; k++) {
+                if (j->fd[k] < 0) continue;
+                owner[n] = j;
+                pfd[n++] = (struct pollfd){ j->fd[k], k == 2 ? POLLOUT : POLLIN, 0 };
+            }
+            if (j->reaped) continue;
+            if (j->pidfd >= 0) {
+                owner[n] = j;
+                pfd[n++] = (struct pollfd){ j->pidfd, POLLIN, 0 };
+            } else if (wait_ms < 0 || wait_ms > 50) {
+                wait_ms = 50;       // no pidfd: look again soon
+            }
+        }
+        int nin = n;
+        if (!eof && room) pfd[n++] = (struct pollfd){ STDIN_FILENO, POLLIN, 0 };
+        if (poll(pfd, (nfds_t)n, wait_ms) < 0 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
 
-            execvp(arguments[0], arguments);
-            // if exec failed:
-            perror("execvp");
-            _exit(127);
+        for (int i = 0; i < nin; i++) {
+            struct batch_job *j = owner[i];
+            if (!pfd[i].revents) continue;
+            if (pfd[i].fd == j->pidfd) batch_reap(j);
+            else if (pfd[i].fd == j->fd[2]) batch_feed(j);
+            else batch_read(j, pfd[i].fd == j->fd[1]);
+        }
+        for (int i = 0; i < batch_limit; i++) {
+            struct batch_job *j = &batch[i];
+            if (!j->pid) continue;
+            if (!j->reaped && j->pidfd < 0) batch_reap(j);
+            batch_finish(j);
+        }
+        if (n > nin && pfd[nin].revents) {
+            char buf[65536];
+            ssize_t r = read(STDIN_FILENO, buf, sizeof(buf));
+            if (r > 0) sb_put(&lines, buf, (size_t)r);
+            else if (r == 0 || errno != EINTR) eof = true;
         }
+    }
+    return 0;
+}
 
-        // ---- parent ----
-        if (!background) {
-            fg_child = pid;
-            alarm(10);                 // Task 5: kill child after 10s if still running
-            int status;
-            if (waitpid(pid, &status, 0) < 0) {
-                perror("waitpid");
-            } else if (WIFEXITED(status) &&
-                       WEXITSTATUS(status) == 127) {
-                fprintf(stderr, "An error occurred.\n");
-            }
-            alarm(0);                  // cancel timeout
-            fg_child = -1;
+int main(int argc, char **argv) {
+    // Stores the string typed into the command line.
+    char command_line[MAX_COMMAND_LINE_LEN];
+    // Lines of a definition that is still open.
+    struct strbuf pending = { 0 };
+
+    install_parent_handlers();
+    const char *serve_path = NULL;
+    bool batch = false;             // --jsonl, with at most jsonl at once
+    int jsonl = 0;
+    for (int i = 1; i < argc; i++) {
+        bool ok = true;
+        if (strcmp(argv[i], "--records") == 0 && i + 1 < argc) {
+            if (rec_open(argv[++i]) < 0) return 2;
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[++i];
+        } else if (strcmp(argv[i], "--jsonl") == 0) {
+            batch = true;
+            long n = sysconf(_SC_NPROCESSORS_ONLN);
+            jsonl = n > 0 && n <= INT_MAX ? (int)n : 1;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                ok = batch_parse_limit(argv[++i], &jsonl);
         } else {
-            printf("[bg] started pid %d\n", pid);
+            ok = false;
         }
+        if (!ok) {
+            fprintf(stderr, "usage: %s [--records FD[:json|:bin]] "
+                            "[--serve SOCKET | --jsonl [LIMIT]]\n", argv[0]);
+            return 2;
+        }
+    }
+    atexit(rec_final);
+    if (serve_path) return serve(serve_path);
+    if (batch) return batch_run(jsonl);
+    launcher_start();               // while the shell is still small
+    interactive = isatty(STDIN_FILENO);
+    if (interactive) {
+        hist_open();
+        tasks_start();
+        rc_startup();
     }
 
-    return -1; // should never be reached
+    while (true) {
+        clock_gettime(CLOCK_MONOTONIC, &cmd_finished);
+        jobs_reap();
+        out_flush();
+        rec_flush(false);
+
+        do {
+            // Print the shell prompt with current working directory.
+            print_prompt();   // already does printf + fflush(stdout)
+
+            // Read input from stdin and store it in command_line.
+            // If the user input was EOF (ctrl+d), exit the shell.
+            if (read_line(command_line, sizeof(command_line)) < 0) {
+                if (continuing) fprintf(stderr, "syntax error: unexpected end of file\n");
+                printf("\n");
+                fflush(stdout);
+                fflush(stderr);
+                return 0;
+            }
+        } while (command_line[0] == '\0');  // while just ENTER pressed
+
+        hist_add(command_line);
+        clock_gettime(CLOCK_MONOTONIC, &cmd_started);
+
+        // 1. Parse and run the line: builtins run in the shell, anything
+        //    else is forked and waited for unless it ends with '&'. A line
+        //    that leaves a function body open waits for the next one.
+        if (continuing) sb_put(&pending, "\n", 1);
+        sb_put(&pending, command_line, strlen(command_line));
+        continuing = run_line(pending.p) == PARSE_INCOMPLETE;
+        if (!continuing) pending.len = 0;
+    }
 }